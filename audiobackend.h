@@ -0,0 +1,510 @@
+#ifndef AUDIOBACKEND_H
+#define AUDIOBACKEND_H
+
+#include "portaudio.h"
+#include "audiofile.h"
+#include "audioring.h"
+#include "mixkernels.h"
+#include <stdio.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+///////////////////////////
+// Audio backends
+///////////////////////////
+
+// Format of the stream a backend runs, chosen when it starts
+struct AudioConfig
+{
+	double sampleRate;
+	unsigned long framesPerBuffer;
+	int numChannels;
+};
+
+// Fills one block of non-interleaved channels. Called from the backend's
+// audio thread, so it must not allocate, lock or do I/O.
+typedef void (*AudioRenderProc)(float** channels, unsigned long frames, void* userData);
+
+// Something that pulls audio from a render callback block by block: a
+// sound card, a clock thread or a file. The backend owns the channel
+// buffers the callback renders into.
+class AudioBackend
+{
+public:
+	AudioBackend() : numUnderflows_(0), numOverflows_(0), render_(NULL), userData_(NULL)
+	{
+		config_.sampleRate = 0;
+		config_.framesPerBuffer = 0;
+		config_.numChannels = 0;
+	}
+	virtual ~AudioBackend() {}
+
+	virtual const char* GetName() const = 0;
+
+	// Start calling render every block. Returns false if the stream could
+	// not be opened.
+	virtual bool Start(const AudioConfig& config, AudioRenderProc render, void* userData) = 0;
+	// Stop the stream. render is not called again once this returns.
+	virtual bool Stop() = 0;
+
+	const AudioConfig& GetConfig() const { return config_; }
+
+	// Times the device ran out of audio to play, or was handed audio it
+	// had no room for, since it started. Any thread.
+	virtual unsigned long long GetNumUnderflows() const { return numUnderflows_.load(); }
+	virtual unsigned long long GetNumOverflows() const { return numOverflows_.load(); }
+
+protected:
+	// Size the channel buffers for config, before the stream starts
+	void Prepare(const AudioConfig& config, AudioRenderProc render, void* userData)
+	{
+		config_ = config;
+		render_ = render;
+		userData_ = userData;
+		numUnderflows_ = 0;
+		numOverflows_ = 0;
+		buffers_.assign(config.numChannels, vector<float>(config.framesPerBuffer, 0.0f));
+		channels_.resize(config.numChannels);
+		for (int c=0; c<config.numChannels; c++) {
+			channels_[c] = &buffers_[c][0];
+		}
+	}
+
+	float** Render(unsigned long frames)
+	{
+		render_(&channels_[0], frames, userData_);
+		return &channels_[0];
+	}
+
+	// Render into buffers of the caller's
+	void RenderInto(float** channels, unsigned long frames)
+	{
+		render_(channels, frames, userData_);
+	}
+
+	AudioConfig config_;
+	atomic<unsigned long long> numUnderflows_;
+	atomic<unsigned long long> numOverflows_;
+
+private:
+	AudioRenderProc render_;
+	void* userData_;
+	vector< vector<float> > buffers_;
+	vector<float*> channels_;
+};
+
+void HandleAudioError(PaError err)
+{
+	// print error info here
+	cout << "Audio failed to start. Error code: " << err << endl;
+}
+
+// The default output device through PortAudio
+class PortAudioBackend : public AudioBackend
+{
+public:
+	PortAudioBackend() : stream_(NULL), nonInterleaved_(false) {}
+	~PortAudioBackend() { Stop(); }
+
+	const char* GetName() const { return "portaudio"; }
+
+	// Open the stream non-interleaved, so the render callback fills the
+	// device's own channel buffers and nothing is copied. Set before
+	// starting; not every host API supports it.
+	void SetNonInterleaved(bool nonInterleaved) { nonInterleaved_ = nonInterleaved; }
+
+	bool Start(const AudioConfig& config, AudioRenderProc render, void* userData)
+	{
+		PaStreamParameters outputParameters;
+		PaError err;
+
+		Prepare(config, render, userData);
+
+		// PortAudio counts initializations, so every backend can do this
+		err = Pa_Initialize();
+		if( err != paNoError ) {
+			HandleAudioError(err);
+			return false;
+		}
+
+		outputParameters.device = Pa_GetDefaultOutputDevice(); /* default output device */
+		if (outputParameters.device == paNoDevice) {
+			fprintf(stderr,"Error: No default output device.\n");
+			HandleAudioError(err);
+			Pa_Terminate();
+			return false;
+		}
+
+		outputParameters.channelCount = config.numChannels;
+		outputParameters.sampleFormat = nonInterleaved_ ? (paFloat32 | paNonInterleaved) : paFloat32;
+		outputParameters.suggestedLatency = Pa_GetDeviceInfo( outputParameters.device )->defaultLowOutputLatency;
+		outputParameters.hostApiSpecificStreamInfo = NULL;
+		err = Pa_OpenStream(
+				&stream_,
+				NULL, /* no input */
+				&outputParameters,
+				config.sampleRate,
+				config.framesPerBuffer,
+				(paClipOff | paDitherOff),
+				Callback,
+				this );
+		if( err != paNoError ) {
+			HandleAudioError(err);
+			stream_ = NULL;
+			Pa_Terminate();
+			return false;
+		}
+
+		err = Pa_StartStream( stream_ );
+		if( err != paNoError ) {
+			HandleAudioError(err);
+			Pa_CloseStream( stream_ );
+			stream_ = NULL;
+			Pa_Terminate();
+			return false;
+		}
+		return true;
+	}
+
+	bool Stop()
+	{
+		if (!stream_) {
+			return true;
+		}
+		PaError err = Pa_CloseStream( stream_ );
+		stream_ = NULL;
+		Pa_Terminate();
+		if( err != paNoError ) {
+			HandleAudioError(err);
+			return false;
+		}
+		return true;
+	}
+
+private:
+	/* This routine will be called by the PortAudio engine when audio is needed.
+	** It may called at interrupt level on some machines so don't do anything
+	** that could mess up the system like calling malloc() or free().
+	*/
+	static int Callback( const void *inputBuffer, void *outputBuffer,
+	                     unsigned long framesPerBuffer,
+	                     const PaStreamCallbackTimeInfo* timeInfo,
+	                     PaStreamCallbackFlags statusFlags,
+	                     void *userData )
+	{
+		(void) inputBuffer; /* Prevent "unused variable" warnings. */
+		PortAudioBackend* backend = (PortAudioBackend*)userData;
+		if (statusFlags & paOutputUnderflow) {
+			backend->numUnderflows_++;
+		}
+		if (statusFlags & paOutputOverflow) {
+			backend->numOverflows_++;
+		}
+		if (backend->nonInterleaved_) {
+			// an array of channel buffers
+			backend->RenderInto((float**)outputBuffer, framesPerBuffer);
+			return 0;
+		}
+		float** channels = backend->Render(framesPerBuffer);
+		Interleave((float*)outputBuffer, channels, backend->config_.numChannels, framesPerBuffer);
+		return 0;
+	}
+
+	PaStream* stream_;
+	bool nonInterleaved_;
+};
+
+// Calls the render callback from a thread of its own, one block every
+// framesPerBuffer / sampleRate seconds like a sound card would, and hands
+// each block to Deliver. Lets the real-time path run where there is no
+// sound card. A block that is not rendered by the time the next one is
+// due counts as late, which is where a sound card would have underrun, so
+// it is counted as an underflow too.
+// With real time off it renders as fast as it can.
+class ClockBackend : public AudioBackend
+{
+public:
+	ClockBackend() : realTime_(true), blockLimit_(0), running_(false), numBlocks_(0) {}
+
+	void SetRealTime(bool realTime) { realTime_ = realTime; }
+	// Stop rendering after this many blocks, 0 for no limit
+	void SetBlockLimit(unsigned long long blockLimit) { blockLimit_ = blockLimit; }
+
+	bool Start(const AudioConfig& config, AudioRenderProc render, void* userData)
+	{
+		Prepare(config, render, userData);
+		if (!OpenSink()) {
+			return false;
+		}
+		numBlocks_ = 0;
+		running_ = true;
+		thread_ = thread(&ClockBackend::Run, this);
+		return true;
+	}
+
+	bool Stop()
+	{
+		if (!thread_.joinable()) {
+			return true;
+		}
+		running_ = false;
+		thread_.join();
+		return CloseSink();
+	}
+
+	unsigned long long GetNumBlocks() const { return numBlocks_.load(); }
+	unsigned long long GetNumLate() const { return numUnderflows_.load(); }
+
+protected:
+	// Where rendered blocks go, called on the clock thread
+	virtual bool OpenSink() { return true; }
+	virtual void Deliver(float** channels, unsigned long frames) {}
+	virtual bool CloseSink() { return true; }
+
+private:
+	void Run()
+	{
+		typedef chrono::steady_clock Clock;
+		unsigned long frames = config_.framesPerBuffer;
+		Clock::time_point start = Clock::now();
+		// blocks since start, deadlines are counted from it so rounding
+		// never adds up to drift
+		unsigned long long blocks = 0;
+		while (running_.load() && (blockLimit_ == 0 || numBlocks_.load() < blockLimit_)) {
+			Deliver(Render(frames), frames);
+			numBlocks_++;
+			if (!realTime_) {
+				continue;
+			}
+			blocks++;
+			Clock::time_point deadline = start + chrono::duration_cast<Clock::duration>(
+				chrono::duration<double>(blocks * frames / config_.sampleRate));
+			Clock::time_point now = Clock::now();
+			if (now > deadline) {
+				// a sound card would have played silence, carry on from now
+				numUnderflows_++;
+				start = now;
+				blocks = 0;
+			}
+			else {
+				this_thread::sleep_until(deadline);
+			}
+		}
+	}
+
+	bool realTime_;
+	unsigned long long blockLimit_;
+	atomic<bool> running_;
+	atomic<unsigned long long> numBlocks_;
+	thread thread_;
+};
+
+// Runs the clock and throws the audio away, for soak tests
+class NullBackend : public ClockBackend
+{
+public:
+	~NullBackend() { Stop(); }
+
+	const char* GetName() const { return "null"; }
+};
+
+// Runs the clock and writes the audio to a file
+class FileBackend : public ClockBackend
+{
+public:
+	FileBackend() : format_(SAMPLE_FLOAT32), raw_(false) {}
+	~FileBackend() { Stop(); }
+
+	const char* GetName() const { return "file"; }
+
+	// File to write, set before starting
+	void SetFile(const char* fileName, SampleFormat format = SAMPLE_FLOAT32, bool raw = false)
+	{
+		fileName_ = fileName;
+		format_ = format;
+		raw_ = raw;
+	}
+
+	// Once stopped
+	unsigned long long GetFramesWritten() const { return writer_.GetFramesWritten(); }
+
+protected:
+	bool OpenSink()
+	{
+		if (!writer_.Open(fileName_.c_str(), format_, raw_, config_.numChannels, config_.sampleRate, config_.framesPerBuffer)) {
+			fprintf(stderr, "Could not create %s\n", fileName_.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	void Deliver(float** channels, unsigned long frames)
+	{
+		writer_.Write(channels, frames);
+	}
+
+	bool CloseSink()
+	{
+		if (writer_.IsFull()) {
+			fprintf(stderr, "Stopped %s at the 4 GiB a WAV header can describe\n", fileName_.c_str());
+		}
+		return writer_.Close();
+	}
+
+private:
+	string fileName_;
+	SampleFormat format_;
+	bool raw_;
+	AudioFileWriter writer_;
+};
+
+// Renders ahead of another backend on a thread of its own. The render
+// callback runs up to depth blocks ahead into an AudioRing and the device
+// backend's callback only copies ready audio out of it, so a block that
+// takes too long (a plugin spiking, a page fault) is absorbed by the ring
+// instead of making the device underrun. The price is depth blocks of
+// latency, which is also how much later transport commands and reloads
+// are heard.
+class RenderAheadBackend : public AudioBackend
+{
+public:
+	RenderAheadBackend(AudioBackend& device, unsigned int depth = 4)
+	: device_(device), depth_(depth), waitForData_(false), running_(false), readBlock_(NULL), readOffset_(0),
+	  numUnderruns_(0), numUnderrunFrames_(0), numRendered_(0) {}
+	~RenderAheadBackend() { Stop(); }
+
+	const char* GetName() const { return device_.GetName(); }
+
+	// Blocks rendered ahead of the device, set before starting
+	void SetDepth(unsigned int depth) { depth_ = depth > 0 ? depth : 1; }
+	// Have the device wait for audio instead of playing silence when the
+	// ring runs dry. For a freewheeling clock, which would otherwise
+	// outrun the render thread.
+	void SetWaitForData(bool waitForData) { waitForData_ = waitForData; }
+
+	bool Start(const AudioConfig& config, AudioRenderProc render, void* userData)
+	{
+		Prepare(config, render, userData);
+		ring_.Allocate(depth_, config.numChannels, config.framesPerBuffer);
+		readBlock_ = NULL;
+		readOffset_ = 0;
+		numUnderruns_ = 0;
+		numUnderrunFrames_ = 0;
+		numRendered_ = 0;
+		running_ = true;
+		thread_ = thread(&RenderAheadBackend::Run, this);
+
+		// fill the ring before the device starts pulling from it
+		while (ring_.GetNumReady() < depth_) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		if (!device_.Start(config, DeviceCallback, this)) {
+			running_ = false;
+			thread_.join();
+			return false;
+		}
+		return true;
+	}
+
+	bool Stop()
+	{
+		if (!thread_.joinable()) {
+			return true;
+		}
+		bool ok = device_.Stop();
+		running_ = false;
+		thread_.join();
+		return ok;
+	}
+
+	// Device callbacks the ring could not fill, and the frames of silence
+	// they played instead
+	unsigned long long GetNumUnderruns() const { return numUnderruns_.load(); }
+	unsigned long long GetNumUnderrunFrames() const { return numUnderrunFrames_.load(); }
+	unsigned long long GetNumRendered() const { return numRendered_.load(); }
+
+	// The ring running dry is an underflow as far as the listener can tell
+	unsigned long long GetNumUnderflows() const { return device_.GetNumUnderflows() + numUnderruns_.load(); }
+	unsigned long long GetNumOverflows() const { return device_.GetNumOverflows(); }
+
+private:
+	// Keep the ring full. A full ring means the device is depth blocks
+	// behind, so waiting a fraction of a block loses nothing.
+	void Run()
+	{
+		unsigned long frames = config_.framesPerBuffer;
+		chrono::microseconds pause((long long)(250000.0 * frames / config_.sampleRate) + 1);
+		while (running_.load()) {
+			float** block = ring_.BeginWrite();
+			if (!block) {
+				this_thread::sleep_for(pause);
+				continue;
+			}
+			RenderInto(block, frames);
+			ring_.EndWrite();
+			numRendered_++;
+		}
+	}
+
+	// Only copies, called by the device whenever it needs audio
+	static void DeviceCallback(float** channels, unsigned long frames, void* userData)
+	{
+		RenderAheadBackend* backend = (RenderAheadBackend*)userData;
+		AudioRing& ring = backend->ring_;
+		int numChannels = backend->config_.numChannels;
+		unsigned long blockFrames = ring.GetFrames();
+		unsigned long done = 0;
+		while (done < frames) {
+			if (!backend->readBlock_) {
+				backend->readBlock_ = ring.BeginRead();
+				if (!backend->readBlock_) {
+					if (backend->waitForData_ && backend->running_.load()) {
+						this_thread::yield();
+						continue;
+					}
+					// dry: play silence for the rest of the callback
+					for (int c=0; c<numChannels; c++) {
+						memset(channels[c] + done, 0, (frames - done) * sizeof(float));
+					}
+					backend->numUnderruns_++;
+					backend->numUnderrunFrames_ += frames - done;
+					return;
+				}
+				backend->readOffset_ = 0;
+			}
+			unsigned long n = blockFrames - backend->readOffset_;
+			if (n > frames - done) {
+				n = frames - done;
+			}
+			for (int c=0; c<numChannels; c++) {
+				memcpy(channels[c] + done, backend->readBlock_[c] + backend->readOffset_, n * sizeof(float));
+			}
+			done += n;
+			backend->readOffset_ += n;
+			if (backend->readOffset_ == blockFrames) {
+				ring.EndRead();
+				backend->readBlock_ = NULL;
+			}
+		}
+	}
+
+	AudioBackend& device_;
+	unsigned int depth_;
+	bool waitForData_;
+	AudioRing ring_;
+	atomic<bool> running_;
+	thread thread_;
+	// block the device is part way through, owned by the device's thread
+	float** readBlock_;
+	unsigned long readOffset_;
+	atomic<unsigned long long> numUnderruns_;
+	atomic<unsigned long long> numUnderrunFrames_;
+	atomic<unsigned long long> numRendered_;
+};
+
+#endif
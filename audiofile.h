@@ -0,0 +1,229 @@
+#ifndef AUDIOFILE_H
+#define AUDIOFILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "mixkernels.h"
+using namespace std;
+
+///////////////////////////
+// Audio files
+///////////////////////////
+
+typedef enum
+{
+	SAMPLE_FLOAT32,
+	SAMPLE_INT16,
+	SAMPLE_INT24,
+} SampleFormat;
+
+// Writes interleaved audio to a WAV file, or to a raw file with no header
+class AudioFileWriter
+{
+public:
+	AudioFileWriter() : file_(NULL), format_(SAMPLE_FLOAT32), raw_(false),
+		numChannels_(0), sampleRate_(0), maxFrames_(0), framesWritten_(0), frameLimit_(0), full_(false) {}
+	~AudioFileWriter() { Close(); }
+
+	// maxFrames is the largest block Write will usually be given. The
+	// conversion buffer is sized for it here, so writing never allocates.
+	bool Open(const char* fileName, SampleFormat format, bool raw, int numChannels, double sampleRate, unsigned long maxFrames)
+	{
+		file_ = fopen(fileName, "wb");
+		if (!file_) {
+			return false;
+		}
+		format_ = format;
+		raw_ = raw;
+		numChannels_ = numChannels;
+		sampleRate_ = sampleRate;
+		maxFrames_ = maxFrames > 0 ? maxFrames : 1;
+		framesWritten_ = 0;
+		full_ = false;
+		// WAV sizes are 32 bit, the RIFF size counting all but 8 bytes of
+		// the header and the data chunk's pad byte
+		frameLimit_ = raw_ ? ~0ULL : (0xFFFFFFFFULL - (GetHeaderSize() - 8) - 1) / (numChannels_ * GetBytesPerSample());
+		buffer_.resize(maxFrames_ * numChannels_ * GetBytesPerSample());
+		pieces_.resize(numChannels_);
+		if (!raw_) {
+			// sizes are filled in when the file is closed
+			WriteHeader();
+		}
+		return true;
+	}
+
+	// Interleave and convert one block of non-interleaved channels. A block
+	// larger than maxFrames goes out in pieces. Returns false once a WAV file
+	// is full, see IsFull, with as much of the block written as fits.
+	bool Write(float** channels, unsigned long frames)
+	{
+		if (framesWritten_ + frames > frameLimit_) {
+			full_ = true;
+			unsigned long fits = (unsigned long)(frameLimit_ - framesWritten_);
+			if (fits > 0) {
+				Write(channels, fits);
+			}
+			return false;
+		}
+		if (frames > maxFrames_) {
+			for (unsigned long done=0; done<frames; done+=maxFrames_) {
+				for (int c=0; c<numChannels_; c++) {
+					pieces_[c] = channels[c] + done;
+				}
+				if (!Write(&pieces_[0], frames - done < maxFrames_ ? frames - done : maxFrames_)) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		size_t bytesPerSample = GetBytesPerSample();
+		size_t size = frames * numChannels_ * bytesPerSample;
+		unsigned char* out = &buffer_[0];
+		if (format_ == SAMPLE_FLOAT32) {
+			// floats go out as they are, WAV and the host are both little endian
+			Interleave((float*)out, channels, numChannels_, frames);
+			framesWritten_ += frames;
+			return fwrite(&buffer_[0], 1, size, file_) == size;
+		}
+		for (unsigned long i=0; i<frames; i++) {
+			for (int c=0; c<numChannels_; c++) {
+				float sample = channels[c][i];
+				switch (format_)
+				{
+				case SAMPLE_INT16:
+					PutLittleEndian(out, ToInteger(sample, 32767), 2);
+					break;
+				case SAMPLE_INT24:
+					PutLittleEndian(out, ToInteger(sample, 8388607), 3);
+					break;
+				default:
+					break;
+				}
+				out += bytesPerSample;
+			}
+		}
+		framesWritten_ += frames;
+		return fwrite(&buffer_[0], 1, size, file_) == size;
+	}
+
+	bool Close()
+	{
+		if (!file_) {
+			return true;
+		}
+		bool ok = true;
+		if (!raw_) {
+			if ((framesWritten_ * numChannels_ * GetBytesPerSample()) & 1) {
+				ok = fputc(0, file_) != EOF;
+			}
+			fseek(file_, 0, SEEK_SET);
+			ok = WriteHeader() && ok;
+		}
+		ok = (fclose(file_) == 0) && ok;
+		file_ = NULL;
+		return ok;
+	}
+
+	unsigned long long GetFramesWritten() const { return framesWritten_; }
+	// A WAV file reached the 4 GiB its header can describe, and the rest was
+	// not written
+	bool IsFull() const { return full_; }
+
+private:
+	size_t GetHeaderSize() const { return format_ == SAMPLE_FLOAT32 ? 80 : 68; }
+
+	size_t GetBytesPerSample() const
+	{
+		switch (format_)
+		{
+		case SAMPLE_INT16: return 2;
+		case SAMPLE_INT24: return 3;
+		default: return 4;
+		}
+	}
+
+	static long ToInteger(float sample, long fullScale)
+	{
+		if (sample > 1.0f) {
+			sample = 1.0f;
+		}
+		else if (sample < -1.0f) {
+			sample = -1.0f;
+		}
+		float scaled = sample * fullScale;
+		return (long)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+	}
+
+	static void PutLittleEndian(unsigned char* out, unsigned long value, int numBytes)
+	{
+		for (int i=0; i<numBytes; i++) {
+			out[i] = (unsigned char)(value >> (8 * i));
+		}
+	}
+
+	// A WAVE_FORMAT_EXTENSIBLE header, which spells out the sample type and
+	// speaker layout for readers that will not guess them from the plain
+	// one. Float files also get the fact chunk the format asks for.
+	bool WriteHeader()
+	{
+		unsigned long bytesPerSample = (unsigned long)GetBytesPerSample();
+		unsigned long blockAlign = numChannels_ * bytesPerSample;
+		unsigned long dataSize = (unsigned long)(framesWritten_ * blockAlign);
+		unsigned long rate = (unsigned long)sampleRate_;
+		bool isFloat = format_ == SAMPLE_FLOAT32;
+
+		// KSDATAFORMAT_SUBTYPE_PCM or _IEEE_FLOAT, little endian
+		static const unsigned char subFormat[16] = {
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+			0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+		};
+		// front left and right, or front center for mono
+		unsigned long channelMask = numChannels_ == 1 ? 0x4 : numChannels_ == 2 ? 0x3 : 0;
+
+		unsigned char header[80];
+		size_t size = GetHeaderSize();
+		memcpy(header, "RIFF", 4);
+		// the data chunk is padded to an even size
+		PutLittleEndian(header + 4, (unsigned long)(size - 8) + dataSize + (dataSize & 1), 4);
+		memcpy(header + 8, "WAVE", 4);
+		memcpy(header + 12, "fmt ", 4);
+		PutLittleEndian(header + 16, 40, 4);
+		PutLittleEndian(header + 20, 0xFFFE, 2); // WAVE_FORMAT_EXTENSIBLE
+		PutLittleEndian(header + 22, numChannels_, 2);
+		PutLittleEndian(header + 24, rate, 4);
+		PutLittleEndian(header + 28, rate * blockAlign, 4);
+		PutLittleEndian(header + 32, blockAlign, 2);
+		PutLittleEndian(header + 34, bytesPerSample * 8, 2);
+		PutLittleEndian(header + 36, 22, 2);
+		PutLittleEndian(header + 38, bytesPerSample * 8, 2); // valid bits
+		PutLittleEndian(header + 40, channelMask, 4);
+		memcpy(header + 44, subFormat, 16);
+		header[44] = isFloat ? 3 : 1;
+		unsigned char* data = header + 60;
+		if (isFloat) {
+			memcpy(header + 60, "fact", 4);
+			PutLittleEndian(header + 64, 4, 4);
+			PutLittleEndian(header + 68, (unsigned long)framesWritten_, 4);
+			data = header + 72;
+		}
+		memcpy(data, "data", 4);
+		PutLittleEndian(data + 4, dataSize, 4);
+		return fwrite(header, 1, size, file_) == size;
+	}
+
+	FILE* file_;
+	SampleFormat format_;
+	bool raw_;
+	int numChannels_;
+	double sampleRate_;
+	unsigned long maxFrames_;
+	unsigned long long framesWritten_;
+	unsigned long long frameLimit_;
+	bool full_;
+	vector<unsigned char> buffer_;
+	vector<float*> pieces_; // channels of a block written in pieces
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef AUDIORING_H
+#define AUDIORING_H
+
+#include <atomic>
+#include <vector>
+using namespace std;
+
+///////////////////////////
+// Audio ring
+///////////////////////////
+
+// Blocks of non-interleaved audio passed from a render thread to the audio
+// callback through a lock-free single producer / single consumer ring.
+// The producer renders straight into a free block and publishes it, the
+// consumer reads it in place and hands it back, so nothing is copied
+// twice and neither side ever blocks.
+class AudioRing
+{
+public:
+	AudioRing() : depth_(0), mask_(0), frames_(0), numChannels_(0), head_(0), tail_(0) {}
+
+	// Room for depth blocks of numChannels x frames. Before either side
+	// starts.
+	void Allocate(unsigned int depth, int numChannels, unsigned long frames)
+	{
+		// slots are a power of 2 so the counters can wrap, only depth are used
+		unsigned int numSlots = 1;
+		while (numSlots < depth) {
+			numSlots *= 2;
+		}
+		depth_ = depth;
+		mask_ = numSlots - 1;
+		frames_ = frames;
+		numChannels_ = numChannels;
+		samples_.assign((size_t)numSlots * numChannels * frames, 0.0f);
+		channels_.resize((size_t)numSlots * numChannels);
+		for (size_t i=0; i<channels_.size(); i++) {
+			channels_[i] = &samples_[i * frames];
+		}
+		head_.store(0, memory_order_relaxed);
+		tail_.store(0, memory_order_relaxed);
+	}
+
+	unsigned int GetDepth() const { return depth_; }
+	unsigned long GetFrames() const { return frames_; }
+
+	// Producer. The channels of the next free block, or NULL if the ring
+	// is full.
+	float** BeginWrite()
+	{
+		unsigned int head = head_.load(memory_order_relaxed);
+		if (head - tail_.load(memory_order_acquire) >= depth_) {
+			return NULL;
+		}
+		return &channels_[(head & mask_) * numChannels_];
+	}
+
+	// Producer. Publish the block BeginWrite returned.
+	void EndWrite()
+	{
+		head_.store(head_.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+
+	// Consumer. The channels of the oldest rendered block, or NULL if the
+	// ring is empty.
+	float** BeginRead()
+	{
+		unsigned int tail = tail_.load(memory_order_relaxed);
+		if (tail == head_.load(memory_order_acquire)) {
+			return NULL;
+		}
+		return &channels_[(tail & mask_) * numChannels_];
+	}
+
+	// Consumer. Free the block BeginRead returned.
+	void EndRead()
+	{
+		tail_.store(tail_.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+
+	// Blocks rendered and not read yet, from either side
+	unsigned int GetNumReady() const
+	{
+		return head_.load(memory_order_acquire) - tail_.load(memory_order_acquire);
+	}
+
+private:
+	unsigned int depth_;
+	unsigned int mask_;
+	unsigned long frames_;
+	int numChannels_;
+	vector<float> samples_;
+	vector<float*> channels_;
+	atomic<unsigned int> head_;
+	atomic<unsigned int> tail_;
+};
+
+#endif
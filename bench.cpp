@@ -0,0 +1,619 @@
+// Benchmarks for the engine: generates synthetic songs and times the lexer,
+// the parser, compiling, the streaming scheduler, event dispatch and
+// offline rendering separately. Results are written as JSON so runs can be
+// compared by a script.
+//
+// With -verify it instead checks, on the same songs, that the fast paths
+// agree with the plain ones: the parallel parse with the serial one, a
+// cached song with a freshly compiled one, locating with replaying the song
+// from the start, and the vector synth with its scalar lane.
+//
+// usage: lumabench [-runs n] [-scale n] [-out file.json] [-verify]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include "render.h"
+
+using namespace std;
+
+///////////////////////////
+// Synthetic songs
+///////////////////////////
+
+struct BenchSong
+{
+	const char* name;
+	string text;
+};
+
+// A pattern nested depth levels deep, every level played twice
+static string MakeDeepSong(int depth)
+{
+	string text;
+	for (int i=0; i<depth; i++) {
+		text += "[";
+	}
+	text += "cmaj_4_1_100_1, _1";
+	for (int i=0; i<depth; i++) {
+		text += "] # 2";
+	}
+	return text + "\n";
+}
+
+// A few short patterns with very large repeat counts
+static string MakeRepeatSong(int repeats)
+{
+	char line[128];
+	string text;
+	for (int i=0; i<4; i++) {
+		snprintf(line, sizeof(line), "[cmaj_4_%d_100_1, _1, cmin_5_%d_90_1, _2] # %d\n", i + 1, i + 3, repeats);
+		text += line;
+	}
+	return text;
+}
+
+// Many independent top-level patterns, each starting after a rest so
+// they do not all strike at once
+static string MakeManyPatternSong(int numPatterns)
+{
+	static const char* scales[] = { "cmaj", "dmin", "fsdorian", "bbmaj", "eaeolian", "gmixolydian" };
+	char line[256];
+	string text;
+	for (int i=0; i<numPatterns; i++) {
+		snprintf(line, sizeof(line), "[_%d, %s_%d_%d_%d_1, _1, %s_%d_%d_90_2, _%d] # %d\n",
+			1 + i % 512, scales[i % 6], 3 + i % 4, 1 + i % 7, 60 + i % 60,
+			scales[(i + 1) % 6], 4 + i % 3, 1 + i % 5, 1 + i % 3, 1 + i % 4);
+		text += line;
+	}
+	return text;
+}
+
+// Patterns on several channels, with scales defined and redefined along
+// the way, so a parallel parse has to see each scale as it stood above
+// every chunk
+static string MakeScaleSong(int numPatterns)
+{
+	static const char* builtins[] = { "cmaj", "dmin", "fsdorian", "bbmaj" };
+	char line[256];
+	string text = "tempo_132\n";
+	int numDefined = 0;
+	for (int i=0; i<numPatterns; i++) {
+		if (i % 97 == 0) {
+			// a new scale, or one defined earlier again
+			int n = i / 97;
+			snprintf(line, sizeof(line), "scale_s%d = [0, %d, %d, 7, %d]\n", n % 8, 1 + n % 3, 3 + n % 2, 9 + n % 3);
+			text += line;
+			numDefined = n + 1 < 8 ? n + 1 : 8;
+		}
+		if (i % 331 == 17) {
+			// the builtins can be redefined too
+			snprintf(line, sizeof(line), "scale_cmaj = [0, 2, %d, 5, 7, 9, 11]\n", 3 + i % 2);
+			text += line;
+		}
+		const char* scale = builtins[i % 4];
+		snprintf(line, sizeof(line), "%d: [_%d, %s_%d_%d_%d_1, s%d_%d_%d_90_2, _1] # %d\n",
+			1 + i % 5, 1 + i % 64, scale, 3 + i % 3, 1 + i % 7, 60 + i % 60,
+			i % numDefined, 4 + i % 2, 1 + i % 5, 1 + i % 3);
+		text += line;
+	}
+	return text;
+}
+
+// Chords of many notes struck together on every beat
+static string MakeChordSong(int chordSize, int repeats)
+{
+	char note[64];
+	string text = "[";
+	for (int i=0; i<chordSize; i++) {
+		snprintf(note, sizeof(note), "%scchrom_%d_%d_100_1", i > 0 ? ", " : "", 2 + i / 12, 1 + i % 12);
+		text += note;
+	}
+	snprintf(note, sizeof(note), ", _1] # %d\n", repeats);
+	return text + note;
+}
+
+///////////////////////////
+// Timing
+///////////////////////////
+
+typedef chrono::steady_clock BenchClock;
+
+static double SecondsSince(BenchClock::time_point start)
+{
+	return chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+// One line of the report. items is what the stage counts: bytes, tokens,
+// events, blocks or frames, named by unit.
+struct BenchResult
+{
+	string song;
+	string stage;
+	double seconds; // best of the runs
+	double items;
+	const char* unit;
+};
+
+static vector<BenchResult> results;
+
+static void Report(const char* song, const string& stage, double seconds, double items, const char* unit)
+{
+	BenchResult r = { song, stage, seconds, items, unit };
+	results.push_back(r);
+	fprintf(stderr, "%-10s %-20s %10.3f ms %14.0f %s/s\n", song, stage.c_str(), seconds * 1000,
+		seconds > 0 ? items / seconds : 0.0, unit);
+}
+
+///////////////////////////
+// Stages
+///////////////////////////
+
+static void BenchLexer(const BenchSong& song, int runs)
+{
+	double best = 0;
+	size_t numTokens = 0;
+	for (int run=0; run<runs; run++) {
+		LumaLexer lexer;
+		lexer.Start(song.text.data(), song.text.data() + song.text.size());
+		LexToken token;
+		numTokens = 0;
+		BenchClock::time_point start = BenchClock::now();
+		do {
+			lexer.Next(token);
+			numTokens++;
+		} while (token.type != LEX_END);
+		double seconds = SecondsSince(start);
+		best = run == 0 || seconds < best ? seconds : best;
+	}
+	Report(song.name, "lex", best, (double)numTokens, "tokens");
+}
+
+static void BenchParser(const BenchSong& song, int runs, unsigned numThreads)
+{
+	double best = 0;
+	for (int run=0; run<runs; run++) {
+		ParseContext parser;
+		parser.SetNumThreads(numThreads);
+		Song target;
+		BenchClock::time_point start = BenchClock::now();
+		parser.ParseText(song.text.data(), song.text.size(), &target);
+		double seconds = SecondsSince(start);
+		best = run == 0 || seconds < best ? seconds : best;
+	}
+	char stage[64];
+	snprintf(stage, sizeof(stage), "parse_%uthreads", numThreads);
+	Report(song.name, stage, best, (double)song.text.size(), "bytes");
+}
+
+static void BenchCompile(const BenchSong& song, Song& target, int runs)
+{
+	double best = 0;
+	Timeline timeline;
+	for (int run=0; run<runs; run++) {
+		BenchClock::time_point start = BenchClock::now();
+		target.Compile(AUDIO_SAMPLE_RATE, timeline);
+		double seconds = SecondsSince(start);
+		best = run == 0 || seconds < best ? seconds : best;
+	}
+	Report(song.name, "compile", best, (double)timeline.GetNumEvents(), "events");
+}
+
+// Runs the streaming scheduler over the whole song. Reported per block so
+// block sizes can be compared with the time a block lasts.
+static void BenchUpdate(const BenchSong& song, Song& target, unsigned long blockSize, int runs)
+{
+	double best = 0;
+	unsigned long numBlocks = 0;
+	SongEventBuffer events;
+	target.SetSampleRate(AUDIO_SAMPLE_RATE);
+	for (int run=0; run<runs; run++) {
+		target.Reset();
+		numBlocks = 0;
+		BenchClock::time_point start = BenchClock::now();
+		while (!target.IsFinished()) {
+			events.Clear();
+			target.Update(blockSize, events);
+			numBlocks++;
+		}
+		double seconds = SecondsSince(start);
+		best = run == 0 || seconds < best ? seconds : best;
+	}
+	char stage[64];
+	snprintf(stage, sizeof(stage), "update_%lu", blockSize);
+	Report(song.name, stage, best, (double)numBlocks, "blocks");
+}
+
+// An effect that takes events and renders nothing, so dispatch is timed on
+// its own
+static VstIntPtr VSTCALLBACK NullDispatcher(AEffect* effect, VstInt32 opcode, VstInt32 index, VstIntPtr value, void* ptr, float opt)
+{
+	return 0;
+}
+
+// Fills the event batch from the compiled timeline one block at a time and
+// hands it to a plugin that does nothing with it
+static void BenchDispatch(const BenchSong& song, Song& target, int runs)
+{
+	Timeline timeline;
+	target.Compile(AUDIO_SAMPLE_RATE, timeline);
+	AEffect nullEffect;
+	memset(&nullEffect, 0, sizeof(nullEffect));
+	nullEffect.dispatcher = NullDispatcher;
+	MidiEventBatch* batch = new MidiEventBatch();
+
+	double best = 0;
+	for (int run=0; run<runs; run++) {
+		TimelineCursor cursor;
+		cursor.SetTimeline(&timeline);
+		BenchClock::time_point start = BenchClock::now();
+		while (!cursor.IsFinished()) {
+			long long blockStart = cursor.GetPosition();
+			size_t first, last;
+			cursor.Advance(AUDIO_FRAMES_PER_BUFFER, first, last);
+			for (size_t j=first; j<last; j++) {
+				int offset = (int)(timeline.GetPosition(j) - blockStart);
+				if (IsNoteOff(timeline.GetStatus(j))) {
+					PlayNoteOff(*batch, offset, timeline.GetPitch(j));
+				}
+				else {
+					PlayNoteOn(*batch, offset, timeline.GetPitch(j), timeline.GetVelocity(j), 0);
+				}
+			}
+			batch->dispatch(&nullEffect);
+		}
+		double seconds = SecondsSince(start);
+		best = run == 0 || seconds < best ? seconds : best;
+	}
+	delete batch;
+	Report(song.name, "dispatch", best, (double)timeline.GetNumEvents(), "events");
+}
+
+// Sends stdout to /dev/null while in scope, for the plugin messages the
+// session prints that would otherwise end up in the JSON
+class QuietStdout
+{
+public:
+	QuietStdout()
+	{
+		fflush(stdout);
+		saved_ = dup(1);
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(devNull, 1);
+		close(devNull);
+	}
+	~QuietStdout()
+	{
+		fflush(stdout);
+		dup2(saved_, 1);
+		close(saved_);
+	}
+
+private:
+	int saved_;
+};
+
+// The whole block pipeline through the built-in synth, without writing
+// the audio anywhere
+static void BenchRender(const BenchSong& song, int runs)
+{
+	double best = 0;
+	unsigned long long frames = 0;
+	{
+		QuietStdout quiet;
+		Session* session = new Session();
+		session->SetLogEvents(false);
+		session->Parse(song.text.data(), song.text.size());
+		session->Compile();
+		session->LoadBuiltinSynth();
+
+		float** outputs = session->GetOutputBuffers();
+		for (int run=0; run<runs; run++) {
+			session->Rewind();
+			frames = 0;
+			BenchClock::time_point start = BenchClock::now();
+			while (!session->IsFinished()) {
+				session->RenderBlock(outputs, AUDIO_FRAMES_PER_BUFFER);
+				frames += AUDIO_FRAMES_PER_BUFFER;
+			}
+			double seconds = SecondsSince(start);
+			best = run == 0 || seconds < best ? seconds : best;
+		}
+		delete session;
+	}
+	Report(song.name, "render", best, (double)frames, "frames");
+}
+
+///////////////////////////
+// Checks
+///////////////////////////
+
+static int numFailed = 0;
+
+static void Check(const char* song, const char* what, bool ok, const char* detail = "")
+{
+	fprintf(stderr, "%-10s %-20s %s%s\n", song, what, ok ? "ok" : "FAILED", detail);
+	if (!ok) {
+		numFailed++;
+	}
+}
+
+static bool SameTimeline(const Timeline& a, const Timeline& b)
+{
+	size_t n = a.GetNumEvents();
+	if (n != b.GetNumEvents() || a.GetNumBars() != b.GetNumBars() || a.GetNoteIndexSize() != b.GetNoteIndexSize()) {
+		return false;
+	}
+	return (n == 0 ||
+		(memcmp(a.GetPositions(), b.GetPositions(), n * sizeof(long long)) == 0 &&
+		memcmp(a.GetStatuses(), b.GetStatuses(), n) == 0 &&
+		memcmp(a.GetPitches(), b.GetPitches(), n) == 0 &&
+		memcmp(a.GetVelocities(), b.GetVelocities(), n) == 0)) &&
+		(a.GetNumBars() == 0 || memcmp(a.GetBars(), b.GetBars(), a.GetNumBars() * sizeof(long long)) == 0) &&
+		(a.GetNoteIndexSize() == 0 || memcmp(a.GetNoteIndex(), b.GetNoteIndex(), a.GetNoteIndexSize()) == 0);
+}
+
+static int CompileSong(const BenchSong& song, unsigned numThreads, Timeline& timeline)
+{
+	ParseContext parser;
+	parser.SetNumThreads(numThreads);
+	// split even the small songs
+	parser.SetParallelMinSize(0);
+	parser.silent = true;
+	Song target;
+	int ret = parser.ParseText(song.text.data(), song.text.size(), &target);
+	target.Compile(AUDIO_SAMPLE_RATE, timeline);
+	return ret;
+}
+
+// The song parsed on several threads compiles to the same timeline as
+// parsed on one
+static void VerifyParallelParse(const BenchSong& song, const Timeline& serial, int serialResult)
+{
+	unsigned numThreads = thread::hardware_concurrency();
+	Timeline parallel;
+	int result = CompileSong(song, numThreads > 4 ? numThreads : 4, parallel);
+	Check(song.name, "parallel_parse", result == serialResult && SameTimeline(serial, parallel));
+}
+
+// A timeline written to the song cache and mapped back is the one written
+static void VerifyCache(const BenchSong& song, const Timeline& compiled)
+{
+	char fileName[256];
+	snprintf(fileName, sizeof(fileName), "%s/lumabench-%d%s", P_tmpdir, (int)getpid(), SONG_CACHE_EXTENSION);
+	unsigned long long hash = SongCache::HashSource(song.text.data(), song.text.size());
+	Timeline cached;
+	SongCache cache;
+	bool ok = SongCache::Save(fileName, hash, AUDIO_SAMPLE_RATE, 120.0f, compiled) &&
+		cache.Load(fileName, hash, AUDIO_SAMPLE_RATE, 120.0f, cached) &&
+		SameTimeline(compiled, cached);
+	cache.Close();
+	remove(fileName);
+	Check(song.name, "song_cache", ok);
+}
+
+// Locate and the sounding notes it chases agree with walking the timeline
+// from the start
+static void VerifyLocate(const BenchSong& song, const Timeline& timeline)
+{
+	size_t numEvents = timeline.GetNumEvents();
+	unsigned char replayed[MIDI_NUM_KEYS];
+	unsigned char located[MIDI_NUM_KEYS];
+	memset(replayed, 0, sizeof(replayed));
+	bool soundingOk = true;
+	for (size_t i=0; i<=numEvents && soundingOk; i++) {
+		timeline.GetSounding(i, located);
+		soundingOk = memcmp(located, replayed, MIDI_NUM_KEYS) == 0;
+		if (i < numEvents) {
+			unsigned char status = timeline.GetStatus(i);
+			replayed[GetNoteKey(status, timeline.GetPitch(i))] = IsNoteOff(status) ? 0 : timeline.GetVelocity(i);
+		}
+	}
+	Check(song.name, "sounding", soundingOk);
+
+	// every event position and the sample after it, in order, so the
+	// expected index only ever moves forwards
+	TimelineCursor cursor;
+	cursor.SetTimeline(&timeline);
+	bool locateOk = true;
+	size_t expected = 0;
+	for (size_t i=0; i<numEvents && locateOk; i++) {
+		if (i > 0 && timeline.GetPosition(i) == timeline.GetPosition(i - 1)) {
+			continue;
+		}
+		for (long long position = timeline.GetPosition(i); position <= timeline.GetPosition(i) + 1; position++) {
+			while (expected < numEvents && timeline.GetPosition(expected) < position) {
+				expected++;
+			}
+			cursor.Locate(position);
+			locateOk = locateOk && cursor.GetIndex() == expected && cursor.GetPosition() == position;
+		}
+	}
+	Check(song.name, "locate", locateOk);
+}
+
+// Plays up to maxFrames of the timeline through a synth
+static void PlaySynth(SimdSynth& synth, const Timeline& timeline, unsigned long maxFrames, vector<float>& out)
+{
+	AEffect* effect = synth.GetEffect();
+	effect->dispatcher(effect, effSetSampleRate, 0, 0, 0, (float)AUDIO_SAMPLE_RATE);
+	effect->dispatcher(effect, effMainsChanged, 0, 1, 0, 0);
+	MidiEventBatch* batch = new MidiEventBatch();
+	vector<float> left(AUDIO_FRAMES_PER_BUFFER), right(AUDIO_FRAMES_PER_BUFFER);
+	float* outputs[2] = { &left[0], &right[0] };
+	TimelineCursor cursor;
+	cursor.SetTimeline(&timeline);
+	out.clear();
+	while (!cursor.IsFinished() && out.size() < maxFrames) {
+		long long blockStart = cursor.GetPosition();
+		size_t first, last;
+		cursor.Advance(AUDIO_FRAMES_PER_BUFFER, first, last);
+		for (size_t j=first; j<last; j++) {
+			int offset = (int)(timeline.GetPosition(j) - blockStart);
+			unsigned char status = timeline.GetStatus(j);
+			if (IsNoteOff(status)) {
+				PlayNoteOff(*batch, offset, timeline.GetPitch(j), GetChannel(status));
+			}
+			else {
+				PlayNoteOn(*batch, offset, timeline.GetPitch(j), timeline.GetVelocity(j), 0, GetChannel(status));
+			}
+		}
+		batch->dispatch(effect);
+		effect->processReplacing(effect, NULL, outputs, AUDIO_FRAMES_PER_BUFFER);
+		out.insert(out.end(), left.begin(), left.end());
+	}
+	delete batch;
+}
+
+// The vector synth sounds like its scalar lane, up to the rounding of
+// summing the voices in another order
+static void VerifySynth(const BenchSong& song, const Timeline& timeline)
+{
+	// the first ten seconds are plenty
+	unsigned long maxFrames = (unsigned long)(AUDIO_SAMPLE_RATE * 10);
+	SimdSynth* vector = new SimdSynth();
+	SimdSynth* scalar = new SimdSynth();
+	scalar->SetScalar(true);
+	std::vector<float> vectorOut, scalarOut;
+	PlaySynth(*vector, timeline, maxFrames, vectorOut);
+	PlaySynth(*scalar, timeline, maxFrames, scalarOut);
+	delete vector;
+	delete scalar;
+
+	float maxDiff = 0;
+	for (size_t i=0; i<vectorOut.size() && i<scalarOut.size(); i++) {
+		float diff = fabsf(vectorOut[i] - scalarOut[i]);
+		maxDiff = diff > maxDiff ? diff : maxDiff;
+	}
+	char detail[64];
+	snprintf(detail, sizeof(detail), " (%d lanes, largest difference %g)", SYNTH_LANES, maxDiff);
+	Check(song.name, "synth_lanes", vectorOut.size() == scalarOut.size() && maxDiff <= 1e-4f, detail);
+}
+
+static void Verify(const BenchSong& song)
+{
+	Timeline serial;
+	int serialResult = CompileSong(song, 1, serial);
+	Check(song.name, "parse", serialResult == 0);
+	VerifyParallelParse(song, serial, serialResult);
+	VerifyCache(song, serial);
+	VerifyLocate(song, serial);
+	VerifySynth(song, serial);
+}
+
+///////////////////////////
+// Report
+///////////////////////////
+
+static bool WriteJson(FILE* f, int runs, int scale)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"runs\": %d,\n", runs);
+	fprintf(f, "  \"scale\": %d,\n", scale);
+	fprintf(f, "  \"simd_lanes\": %d,\n", SYNTH_LANES);
+	fprintf(f, "  \"results\": [\n");
+	for (size_t i=0; i<results.size(); i++) {
+		const BenchResult& r = results[i];
+		fprintf(f, "    { \"song\": \"%s\", \"stage\": \"%s\", \"seconds\": %.9f, \"items\": %.0f, \"unit\": \"%s\", \"per_second\": %.3f }%s\n",
+			r.song.c_str(), r.stage.c_str(), r.seconds, r.items, r.unit,
+			r.seconds > 0 ? r.items / r.seconds : 0.0, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+	return ferror(f) == 0;
+}
+
+static void PrintUsage()
+{
+	printf("usage: lumabench [options]\n");
+	printf("  -runs <n>          times each stage is run, the best is reported (default 3)\n");
+	printf("  -scale <n>         multiplies the size of the generated songs (default 1)\n");
+	printf("  -out <file>        write the JSON report here instead of stdout\n");
+	printf("  -verify            check the fast paths against the plain ones instead, exit 1 on a mismatch\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int runs = 3;
+	int scale = 1;
+	const char* outputFile = NULL;
+	bool verify = false;
+
+	for (int i=1; i<argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-runs") == 0 && hasValue) {
+			runs = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-scale") == 0 && hasValue) {
+			scale = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-out") == 0 && hasValue) {
+			outputFile = argv[++i];
+		}
+		else if (strcmp(arg, "-verify") == 0) {
+			verify = true;
+		}
+		else {
+			PrintUsage();
+			return 1;
+		}
+	}
+	if (runs < 1 || scale < 1) {
+		PrintUsage();
+		return 1;
+	}
+
+	BenchSong songs[] =
+	{
+		{ "deep", MakeDeepSong(10 + scale) },
+		{ "repeats", MakeRepeatSong(500 * scale) },
+		{ "patterns", MakeManyPatternSong(5000 * scale) },
+		{ "chords", MakeChordSong(48, 200 * scale) },
+		{ "scales", MakeScaleSong(2000 * scale) },
+	};
+	if (verify) {
+		for (size_t i=0; i<sizeof(songs) / sizeof(songs[0]); i++) {
+			Verify(songs[i]);
+		}
+		fprintf(stderr, "%d checks failed\n", numFailed);
+		return numFailed > 0 ? 1 : 0;
+	}
+	unsigned numThreads = thread::hardware_concurrency();
+	static const unsigned long blockSizes[] = { 64, 256, 512, 2048 };
+
+	for (size_t i=0; i<sizeof(songs) / sizeof(songs[0]); i++) {
+		const BenchSong& song = songs[i];
+		BenchLexer(song, runs);
+		BenchParser(song, runs, 1);
+		if (numThreads > 1) {
+			BenchParser(song, runs, numThreads);
+		}
+
+		ParseContext parser;
+		Song target;
+		parser.ParseText(song.text.data(), song.text.size(), &target);
+		BenchCompile(song, target, runs);
+		for (size_t b=0; b<sizeof(blockSizes) / sizeof(blockSizes[0]); b++) {
+			BenchUpdate(song, target, blockSizes[b], runs);
+		}
+		BenchDispatch(song, target, runs);
+		BenchRender(song, runs);
+	}
+
+	FILE* f = outputFile ? fopen(outputFile, "w") : stdout;
+	if (!f) {
+		fprintf(stderr, "Could not create %s\n", outputFile);
+		return 1;
+	}
+	bool ok = WriteJson(f, runs, scale);
+	if (outputFile) {
+		ok = (fclose(f) == 0) && ok;
+	}
+	return ok ? 0 : 1;
+}
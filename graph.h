@@ -0,0 +1,440 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "pluginterfaces/vst2.x/aeffectx.h"
+#include "midievents.h"
+#include "telemetry.h"
+#include "mixkernels.h"
+#include <string.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+using namespace std;
+
+///////////////////////////
+// Processing graph
+///////////////////////////
+
+// Channels that flow between nodes, the host's stereo output. A plugin
+// with more outputs is folded down to these through its channel map.
+static const int GRAPH_CHANNELS = 2;
+
+// Plugin instances wired into a graph that renders one block at a time:
+// instruments that take MIDI, effects that process what feeds them and
+// buses that sum their inputs. Each block every node runs once, after all
+// of its inputs. Nodes whose inputs are done are handed out through a
+// lock-free ready list to a pool of workers and the audio thread, so
+// independent branches (one per instrument, usually) render in parallel.
+//
+// The graph is built and resized while audio is stopped; Process is the
+// only call made from the audio thread.
+class ProcessGraph
+{
+public:
+	ProcessGraph() : output_(-1), direct_(-1), frames_(0), telemetry_(NULL), generation_(0), head_(0), numDone_(0), blockNodes_(0), stopping_(false), numSleeping_(0) {}
+	~ProcessGraph()
+	{
+		SetNumWorkers(0);
+		Clear();
+	}
+
+	// Remove every node. Not while audio runs.
+	void Clear()
+	{
+		for (size_t i=0; i<nodes_.size(); i++) {
+			delete nodes_[i];
+		}
+		nodes_.clear();
+		output_ = -1;
+	}
+
+	// A node rendering through effect, or a bus summing its inputs if effect
+	// is NULL. Returns its index.
+	int AddNode(AEffect* effect)
+	{
+		Node* node = new Node();
+		node->effect = effect;
+		node->numIns = GRAPH_CHANNELS;
+		node->numOuts = GRAPH_CHANNELS;
+		if (effect) {
+			node->numIns = effect->numInputs > GRAPH_CHANNELS ? effect->numInputs : GRAPH_CHANNELS;
+			node->numOuts = effect->numOutputs > 0 ? effect->numOutputs : 0;
+			// outputs past the stereo pair alternate left and right
+			for (int i=0; i<node->numOuts; i++) {
+				node->channelMap.push_back(i % GRAPH_CHANNELS);
+			}
+			// fewer than a pair leaves the plugin's buffers short of the
+			// graph's, a mono plugin is heard on both sides
+			node->mixDown = node->numOuts != GRAPH_CHANNELS;
+			node->spreadMono = node->numOuts == 1;
+		}
+		nodes_.push_back(node);
+		pending_.reset(new atomic<int>[nodes_.size()]);
+		ready_.reset(new atomic<int>[nodes_.size()]);
+		Resize(node);
+		return (int)nodes_.size() - 1;
+	}
+
+	// Feed from's output into to. Inputs are summed in the order they are
+	// connected, so the result does not depend on which thread ran what.
+	// Returns false if the connection would make a cycle.
+	bool Connect(int from, int to)
+	{
+		if (from == to || Reaches(to, from)) {
+			return false;
+		}
+		nodes_[from]->outputs.push_back(to);
+		nodes_[to]->inputs.push_back(from);
+		return true;
+	}
+
+	// Which graph channel each of a plugin node's outputs goes to, negative
+	// to leave it out. Outputs past the end of map are left out. Returns
+	// false if index is not a plugin node, buses have no map.
+	bool SetChannelMap(int index, const vector<int>& map)
+	{
+		if (index < 0 || index >= (int)nodes_.size() || !nodes_[index]->effect) {
+			return false;
+		}
+		Node* node = nodes_[index];
+		bool identity = true;
+		for (int i=0; i<node->numOuts; i++) {
+			int channel = i < (int)map.size() && map[i] < GRAPH_CHANNELS ? map[i] : -1;
+			node->channelMap[i] = channel;
+			identity = identity && channel == i;
+		}
+		node->mixDown = !(identity && node->numOuts == GRAPH_CHANNELS);
+		node->spreadMono = false;
+		return true;
+	}
+
+	// The node whose output Process returns. It renders straight into the
+	// caller's buffers, so nothing may be connected after it. If it is a bus
+	// fed by a single node, that node renders into them instead.
+	void SetOutput(int node) { output_ = node; }
+	int GetOutput() const { return output_; }
+
+	int GetNumNodes() const { return (int)nodes_.size(); }
+	AEffect* GetEffect(int node) const { return nodes_[node]->effect; }
+	// MIDI for the node's next block, filled by the audio thread before
+	// Process
+	MidiEventBatch& GetEvents(int node) { return nodes_[node]->events; }
+
+	// Frames a block may have at most. Not while audio runs.
+	void SetBlockSize(unsigned long frames)
+	{
+		frames_ = frames;
+		for (size_t i=0; i<nodes_.size(); i++) {
+			Resize(nodes_[i]);
+		}
+	}
+
+	// Threads that help the audio thread render, 0 to render everything on
+	// the audio thread. Not while audio runs.
+	void SetNumWorkers(unsigned numWorkers)
+	{
+		if (numWorkers == workers_.size()) {
+			return;
+		}
+		stopping_ = true;
+		wake_.notify_all();
+		for (size_t i=0; i<workers_.size(); i++) {
+			workers_[i].join();
+		}
+		workers_.clear();
+		stopping_ = false;
+		for (unsigned i=0; i<numWorkers; i++) {
+			workers_.push_back(thread(&ProcessGraph::WorkerLoop, this));
+		}
+	}
+	unsigned GetNumWorkers() const { return (unsigned)workers_.size(); }
+
+	// Where the time nodes spend dispatching and processing is counted,
+	// NULL for nowhere
+	void SetTelemetry(Telemetry* telemetry) { telemetry_ = telemetry; }
+
+	// Render one block into outputs, GRAPH_CHANNELS of them. Called from the
+	// audio thread, and returns once every node has run.
+	void Process(float** outputs, unsigned long frames)
+	{
+		int numNodes = (int)nodes_.size();
+		if (output_ < 0) {
+			for (int c=0; c<GRAPH_CHANNELS; c++) {
+				memset(outputs[c], 0, frames * sizeof(float));
+			}
+			return;
+		}
+		callerOutputs_ = outputs;
+		blockFrames_ = frames;
+		blockNodes_ = numNodes;
+
+		// a bus with one input would only copy it, so skip the copy
+		direct_ = -1;
+		const Node& output = *nodes_[output_];
+		if (!output.effect && output.inputs.size() == 1 && nodes_[output.inputs[0]]->outputs.size() == 1) {
+			direct_ = output.inputs[0];
+		}
+
+		// reset the counters, then queue the nodes nothing feeds
+		numDone_ = 0;
+		for (int i=0; i<numNodes; i++) {
+			pending_[i] = (int)nodes_[i]->inputs.size();
+			ready_[i] = -1;
+		}
+		tail_ = 0;
+		for (int i=0; i<numNodes; i++) {
+			if (nodes_[i]->inputs.empty()) {
+				ready_[tail_++] = i;
+			}
+		}
+
+		// the generation in the top half of head_ keeps a worker still on
+		// the last block from claiming a slot of this one
+		unsigned long long generation = generation_.load() + 1;
+		head_ = generation << 32;
+		generation_ = generation;
+		if (numSleeping_.load() > 0) {
+			wake_.notify_all();
+		}
+
+		RunNodes(generation);
+		while (numDone_.load() < numNodes) {
+			this_thread::yield();
+		}
+	}
+
+private:
+	struct Node
+	{
+		Node() : effect(NULL), numIns(0), numOuts(0), mixDown(false), spreadMono(false) {}
+		AEffect* effect; // NULL for a bus
+		vector<int> inputs;
+		vector<int> outputs;
+		// Buffers the plugin sees, as many as it has inputs and outputs but
+		// at least GRAPH_CHANNELS. The inputs sum into the first channels of
+		// in, the rest stay silent. numOuts is what the plugin really has.
+		int numIns;
+		int numOuts;
+		vector< vector<float> > inBuffers;
+		vector< vector<float> > pluginBuffers;
+		vector<float*> in;
+		vector<float*> pluginOut;
+		// pluginOut folded down through channelMap, or the plugin's own
+		// outputs when it has a plain stereo pair
+		vector<int> channelMap;
+		bool mixDown;
+		// the one output of a mono plugin copied to the right as well
+		bool spreadMono;
+		vector<float> outBuffers[GRAPH_CHANNELS];
+		float* out[GRAPH_CHANNELS];
+		MidiEventBatch events;
+	};
+
+	void Resize(Node* node)
+	{
+		AllocateChannels(node->inBuffers, node->in, node->numIns);
+		AllocateChannels(node->pluginBuffers, node->pluginOut, node->numOuts > GRAPH_CHANNELS ? node->numOuts : GRAPH_CHANNELS);
+		for (int c=0; c<GRAPH_CHANNELS; c++) {
+			node->outBuffers[c].assign(frames_, 0.0f);
+			node->out[c] = frames_ > 0 ? &node->outBuffers[c][0] : NULL;
+		}
+	}
+
+	void AllocateChannels(vector< vector<float> >& buffers, vector<float*>& channels, int numChannels)
+	{
+		buffers.assign(numChannels, vector<float>(frames_, 0.0f));
+		channels.resize(numChannels);
+		for (int c=0; c<numChannels; c++) {
+			channels[c] = frames_ > 0 ? &buffers[c][0] : NULL;
+		}
+	}
+
+	// Whether there is a path from one node to another
+	bool Reaches(int from, int to) const
+	{
+		if (from == to) {
+			return true;
+		}
+		const vector<int>& outputs = nodes_[from]->outputs;
+		for (size_t i=0; i<outputs.size(); i++) {
+			if (Reaches(outputs[i], to)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Claim ready nodes of the given block and run them until every node
+	// has been claimed. Returns false if the block is already over.
+	bool RunNodes(unsigned long long generation)
+	{
+		for (;;) {
+			unsigned long long head = head_.load();
+			if ((head >> 32) != generation) {
+				return false;
+			}
+			unsigned long long slot = head & 0xffffffffULL;
+			// the block's own count, workers never look at nodes_ between blocks
+			if (slot >= (unsigned long long)blockNodes_.load()) {
+				return true;
+			}
+			if (!head_.compare_exchange_weak(head, head + 1)) {
+				continue;
+			}
+			// the slot is filled once the node's last input is done, which
+			// cannot be waiting on this thread
+			int node;
+			while ((node = ready_[slot].load()) < 0) {
+				this_thread::yield();
+			}
+			RunNode(node);
+		}
+	}
+
+	void RunNode(int index)
+	{
+		Node& node = *nodes_[index];
+		unsigned long frames = blockFrames_;
+		float** out = index == output_ || index == direct_ ? callerOutputs_ : node.out;
+		if (index == output_ && direct_ >= 0) {
+			// its one input rendered straight into the output
+			FinishNode(node);
+			return;
+		}
+
+		// sum the inputs, first one copied so a single input passes through
+		// untouched. A plugin always gets input buffers, silent for an
+		// instrument, since some read them whether or not they use them.
+		float** in = node.effect ? node.in.data() : out;
+		if (!node.inputs.empty()) {
+			for (size_t i=0; i<node.inputs.size(); i++) {
+				float** source = nodes_[node.inputs[i]]->out;
+				for (int c=0; c<GRAPH_CHANNELS; c++) {
+					if (i == 0) {
+						memcpy(in[c], source[c], frames * sizeof(float));
+					}
+					else {
+						MixAdd(in[c], source[c], frames);
+					}
+				}
+			}
+		}
+		else if (!node.effect) {
+			for (int c=0; c<GRAPH_CHANNELS; c++) {
+				memset(out[c], 0, frames * sizeof(float));
+			}
+		}
+
+		if (node.effect && telemetry_) {
+			Telemetry::Clock::time_point start = Telemetry::Now();
+			node.events.dispatch(node.effect);
+			Telemetry::Clock::time_point dispatched = Telemetry::Now();
+			Render(node, in, out, frames);
+			Telemetry::Clock::time_point processed = Telemetry::Now();
+			telemetry_->AddStage(STAGE_DISPATCH, Telemetry::Elapsed(start, dispatched));
+			telemetry_->AddStage(STAGE_PROCESS, Telemetry::Elapsed(dispatched, processed));
+		}
+		else if (node.effect) {
+			node.events.dispatch(node.effect);
+			Render(node, in, out, frames);
+		}
+		FinishNode(node);
+	}
+
+	// A stereo plugin renders straight into out, anything else into its own
+	// buffers first
+	static void Render(Node& node, float** in, float** out, unsigned long frames)
+	{
+		if (!node.mixDown) {
+			node.effect->processReplacing(node.effect, in, out, frames);
+			return;
+		}
+		node.effect->processReplacing(node.effect, in, &node.pluginOut[0], frames);
+		MixDown(out, GRAPH_CHANNELS, node.pluginOut.data(), node.numOuts, node.channelMap.data(), frames);
+		if (node.spreadMono) {
+			memcpy(out[1], out[0], frames * sizeof(float));
+		}
+	}
+
+	// Release what waits on the node
+	void FinishNode(const Node& node)
+	{
+		for (size_t i=0; i<node.outputs.size(); i++) {
+			int next = node.outputs[i];
+			if (pending_[next].fetch_sub(1) == 1) {
+				ready_[tail_++] = next;
+			}
+		}
+		numDone_++;
+	}
+
+	// Wait for a block, help with it, repeat. Spins a little first since the
+	// next block is often only a moment away, then sleeps.
+	void WorkerLoop()
+	{
+		unsigned long long seen = generation_.load();
+		while (!stopping_.load()) {
+			unsigned long long generation = generation_.load();
+			if (generation == seen) {
+				if (!Idle(seen)) {
+					continue;
+				}
+				generation = generation_.load();
+			}
+			seen = generation;
+			RunNodes(generation);
+		}
+	}
+
+	// Returns true once a new block is out, false on a timeout or stop
+	bool Idle(unsigned long long seen)
+	{
+		for (int i=0; i<WORKER_SPINS; i++) {
+			if (generation_.load() != seen) {
+				return true;
+			}
+			this_thread::yield();
+		}
+		unique_lock<mutex> lock(wakeMutex_);
+		numSleeping_++;
+		// the audio thread never takes the mutex, so a notify can slip in
+		// before the wait; the timeout bounds how long that costs
+		wake_.wait_for(lock, chrono::milliseconds(1));
+		numSleeping_--;
+		return generation_.load() != seen;
+	}
+
+	static const int WORKER_SPINS = 1000;
+
+	vector<Node*> nodes_;
+	int output_;
+	// the output bus's single input, which renders in its place, or -1
+	int direct_;
+	unsigned long frames_;
+	Telemetry* telemetry_;
+
+	// the block being rendered
+	float** callerOutputs_;
+	unsigned long blockFrames_;
+	atomic<unsigned long long> generation_;
+	// ready list: nodes are appended at tail_ and claimed from head_, each
+	// node once per block. pending_ counts the inputs a node still waits for.
+	unique_ptr< atomic<int>[] > pending_;
+	unique_ptr< atomic<int>[] > ready_;
+	atomic<unsigned long long> head_;
+	atomic<int> tail_;
+	atomic<int> numDone_;
+	atomic<int> blockNodes_;
+
+	vector<thread> workers_;
+	atomic<bool> stopping_;
+	atomic<int> numSleeping_;
+	mutex wakeMutex_;
+	condition_variable wake_;
+};
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <string_view>
+#include <charconv>
+#include <vector>
+#include <stdio.h>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+///////////////////////////
+// Source buffer
+///////////////////////////
+
+// The whole input file in memory. The file is mapped where the platform
+// allows it and read in one go otherwise, so the lexer never copies text.
+class SourceBuffer
+{
+public:
+	SourceBuffer() : data_(NULL), size_(0), mapped_(false)
+#if _WIN32
+		, file_(INVALID_HANDLE_VALUE), mapping_(NULL)
+#endif
+	{}
+	~SourceBuffer() { Close(); }
+
+	bool Open(const char* fileName)
+	{
+		Close();
+#if _WIN32
+		file_ = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file_ == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER size;
+		GetFileSizeEx(file_, &size);
+		size_ = (size_t)size.QuadPart;
+		if (size_ > 0) {
+			mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping_) {
+				data_ = (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+				mapped_ = data_ != NULL;
+			}
+		}
+		if (!mapped_) {
+			return ReadAll(fileName);
+		}
+#else
+		int fd = open(fileName, O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			size_ = (size_t)st.st_size;
+			void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				madvise(p, size_, MADV_SEQUENTIAL);
+				data_ = (const char*)p;
+				mapped_ = true;
+			}
+		}
+		close(fd);
+		if (!mapped_) {
+			return ReadAll(fileName);
+		}
+#endif
+		return true;
+	}
+
+	// Read the file into memory without mapping it. For files that may be
+	// truncated while they are read, where a mapping would fault.
+	bool Read(const char* fileName)
+	{
+		Close();
+		return ReadAll(fileName);
+	}
+
+	// Use text that is already in memory
+	void Set(const char* data, size_t size)
+	{
+		Close();
+		data_ = data;
+		size_ = size;
+	}
+
+	void Close()
+	{
+		if (mapped_) {
+#if _WIN32
+			UnmapViewOfFile(data_);
+#else
+			munmap((void*)data_, size_);
+#endif
+		}
+#if _WIN32
+		if (mapping_) {
+			CloseHandle(mapping_);
+			mapping_ = NULL;
+		}
+		if (file_ != INVALID_HANDLE_VALUE) {
+			CloseHandle(file_);
+			file_ = INVALID_HANDLE_VALUE;
+		}
+#endif
+		data_ = NULL;
+		size_ = 0;
+		mapped_ = false;
+		copy_.clear();
+	}
+
+	const char* GetData() const { return data_; }
+	size_t GetSize() const { return size_; }
+
+private:
+	bool ReadAll(const char* fileName)
+	{
+		FILE* f = fopen(fileName, "rb");
+		if (!f) {
+			return false;
+		}
+		char chunk[65536];
+		size_t n;
+		while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+			copy_.insert(copy_.end(), chunk, chunk + n);
+		}
+		fclose(f);
+		data_ = copy_.empty() ? "" : &copy_[0];
+		size_ = copy_.size();
+		return true;
+	}
+
+	const char* data_;
+	size_t size_;
+	bool mapped_;
+	vector<char> copy_;
+#if _WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#endif
+};
+
+///////////////////////////
+// Lexer
+///////////////////////////
+
+enum LexTokenType
+{
+	LEX_END = 0,
+	LEX_NUMBER = 256,
+	LEX_IDENTIFIER,
+	LEX_INVALID, // text the language can not hold, see LexToken::error
+};
+
+// A token points back into the source text, nothing is copied
+struct LexToken
+{
+	int type; // a LexTokenType, or the character itself for punctuation
+	string_view text;
+	int value; // for numbers
+	unsigned int hash; // for identifiers, see LumaLexer::Hash
+	const char* error; // for invalid tokens, what is wrong with them
+	int line;
+	int column;
+};
+
+// Splits luma source into tokens. Spaces, tabs and carriage returns are
+// skipped, newlines are tokens because the grammar ends lines with them.
+class LumaLexer
+{
+public:
+	LumaLexer() : pos_(NULL), end_(NULL), lineStart_(NULL), line_(1) {}
+
+	// firstLine numbers the lines of text that starts partway into a file
+	void Start(const char* begin, const char* end, int firstLine = 1)
+	{
+		pos_ = begin;
+		end_ = end;
+		lineStart_ = begin;
+		line_ = firstLine;
+	}
+
+	void Next(LexToken& token)
+	{
+		while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\r')) {
+			pos_++;
+		}
+
+		const char* start = pos_;
+		token.line = line_;
+		token.column = (int)(start - lineStart_) + 1;
+		token.value = 0;
+		token.hash = 0;
+		token.error = NULL;
+
+		if (pos_ >= end_) {
+			token.type = LEX_END;
+			token.text = string_view();
+			return;
+		}
+
+		char c = *pos_;
+		if (IsDigit(c)) {
+			while (pos_ < end_ && IsDigit(*pos_)) {
+				pos_++;
+			}
+			if (from_chars(start, pos_, token.value).ec == errc::result_out_of_range) {
+				token.type = LEX_INVALID;
+				token.error = "the number is too large";
+			}
+			else {
+				token.type = LEX_NUMBER;
+			}
+		}
+		else if (IsAlpha(c)) {
+			// hash while scanning so the symbol table never rereads the name
+			unsigned int hash = HASH_SEED;
+			while (pos_ < end_ && (IsAlpha(*pos_) || IsDigit(*pos_))) {
+				hash = HashStep(hash, *pos_++);
+			}
+			token.type = LEX_IDENTIFIER;
+			token.hash = hash;
+		}
+		else if (c == '\0') {
+			// a character of its own rather than LEX_END, which would end the parse here
+			pos_++;
+			token.type = LEX_INVALID;
+			token.error = "invalid character";
+		}
+		else {
+			// Any other character is a token by itself
+			pos_++;
+			token.type = (unsigned char)c;
+			if (c == '\n') {
+				line_++;
+				lineStart_ = pos_;
+			}
+		}
+		token.text = string_view(start, pos_ - start);
+	}
+
+	// FNV-1a, the hash identifier tokens carry
+	static unsigned int Hash(string_view s)
+	{
+		unsigned int hash = HASH_SEED;
+		for (size_t i=0; i<s.size(); i++) {
+			hash = HashStep(hash, s[i]);
+		}
+		return hash;
+	}
+
+private:
+	static const unsigned int HASH_SEED = 2166136261u;
+	static unsigned int HashStep(unsigned int hash, char c) { return (hash ^ (unsigned char)c) * 16777619u; }
+
+	static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+	static bool IsAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+	const char* pos_;
+	const char* end_;
+	const char* lineStart_;
+	int line_;
+};
+
+#endif
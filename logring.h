@@ -0,0 +1,142 @@
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+///////////////////////////
+// Log ring
+///////////////////////////
+
+// Diagnostics from the audio thread. The callback may not block or do I/O,
+// so it only copies a small record into a lock-free single producer /
+// single consumer ring. A background thread prints the records.
+
+enum LogType
+{
+	LOG_NOTE_ON,
+	LOG_NOTE_OFF,
+};
+
+struct LogRecord
+{
+	LogType type;
+	long long position;	// sample position in the song
+	int offset;			// frames into the block
+	short channel;		// MIDI channel, 0 to 15
+	short pitch;
+	short velocity;
+};
+
+static const unsigned int LOG_RING_SIZE = 4096; // must be a power of 2
+
+class LogRing
+{
+public:
+	LogRing() : head_(0), tail_(0), numDropped_(0) {}
+
+	// Audio thread only. Drops the record if the reader has fallen behind.
+	bool Push(const LogRecord& record)
+	{
+		unsigned int head = head_.load(memory_order_relaxed);
+		if (head - tail_.load(memory_order_acquire) >= LOG_RING_SIZE) {
+			numDropped_.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		records_[head & (LOG_RING_SIZE - 1)] = record;
+		head_.store(head + 1, memory_order_release);
+		return true;
+	}
+
+	// Log thread only
+	bool Pop(LogRecord& record)
+	{
+		unsigned int tail = tail_.load(memory_order_relaxed);
+		if (tail == head_.load(memory_order_acquire)) {
+			return false;
+		}
+		record = records_[tail & (LOG_RING_SIZE - 1)];
+		tail_.store(tail + 1, memory_order_release);
+		return true;
+	}
+
+	unsigned long TakeNumDropped() { return numDropped_.exchange(0, memory_order_relaxed); }
+
+private:
+	LogRecord records_[LOG_RING_SIZE];
+	atomic<unsigned int> head_;
+	atomic<unsigned int> tail_;
+	atomic<unsigned long> numDropped_;
+};
+
+// Drains a log ring to stdout until stopped
+class LogThread
+{
+public:
+	LogThread() : ring_(NULL), running_(false) {}
+	~LogThread() { Stop(); }
+
+	void Start(LogRing* ring)
+	{
+		if (running_) {
+			return;
+		}
+		ring_ = ring;
+		running_ = true;
+		thread_ = thread(&LogThread::Run, this);
+	}
+
+	void Stop()
+	{
+		if (!running_) {
+			return;
+		}
+		running_ = false;
+		thread_.join();
+		Drain();
+	}
+
+private:
+	void Run()
+	{
+		while (running_) {
+			Drain();
+			this_thread::sleep_for(chrono::milliseconds(10));
+		}
+	}
+
+	void Drain()
+	{
+		LogRecord r;
+		while (ring_->Pop(r)) {
+			// channels are numbered from 1 as in the song, the first is left out
+			char channel[16] = "";
+			if (r.channel > 0) {
+				snprintf(channel, sizeof(channel), " channel %d", r.channel + 1);
+			}
+			switch (r.type)
+			{
+			case LOG_NOTE_ON:
+				printf("Note on %lld +%d%s pitch %d velocity %d\n", r.position, r.offset, channel, r.pitch, r.velocity);
+				break;
+			case LOG_NOTE_OFF:
+				printf("Note off %lld +%d%s pitch %d\n", r.position, r.offset, channel, r.pitch);
+				break;
+			}
+		}
+		unsigned long dropped = ring_->TakeNumDropped();
+		if (dropped > 0) {
+			printf("(%lu log lines dropped)\n", dropped);
+		}
+		fflush(stdout);
+	}
+
+	LogRing* ring_;
+	atomic<bool> running_;
+	thread thread_;
+};
+
+#endif
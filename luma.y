@@ -4,53 +4,96 @@
 #define LUMA_GRAMMAR
 
 #include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <string>
 #include "music.h"
+#include "lexer.h"
+#include "symtab.h"
 
-int yylex (void);
-void yyerror (char const *);
+/* Inputs smaller than this are not worth splitting across threads.  */
+static const size_t PARALLEL_PARSE_MIN_SIZE = 1 << 20;
 
-typedef double (*func_t) (double);
-
- /* Data type for links in the chain of symbols.  */
-struct symrec
+/* A tempo line: bpm from beat onwards.  */
+struct TempoChange
 {
-	char *name;  /* name of symbol */
-	int type;    /* type of symbol: either VAR or FNCT */
-	union
-	{
-		double var;      /* value of a VAR */
-		func_t fnctptr;  /* value of a FNCT */
-		Scale scale;
-	} value;
-	struct symrec *next;  /* link field */
+	long long beat;
+	float bpm;
 };
 
-typedef struct symrec symrec;
-
-/* The symbol table: a chain of `struct symrec'.  */
-extern symrec *sym_table;
-
-symrec *putsym (char const *, int);
-symrec *getsym (char const *);
-
-Song song;
+/* Parser state. Every parse has its own, so the parser is reentrant and
+   several files can be parsed at once on different threads.  */
+struct ParseContext
+{
+	ParseContext ();
+	/* For a chunk of a parallel parse starting at firstLine: the builtins
+	   and scales come from shared's symbols, which are only read.  */
+	ParseContext (ParseContext *shared, int firstLine);
+
+	int ParseFile (const char *fileName, Song *target);
+	int ParseText (const char *text, size_t size, Song *target);
+
+	/* Large inputs are split into chunks of whole top-level lines and
+	   parsed on up to this many threads. 1 parses on the calling thread.  */
+	void SetNumThreads (unsigned n) { numThreads = n > 0 ? n : 1; }
+	/* Inputs at least this large are parsed in parallel, by default
+	   PARALLEL_PARSE_MIN_SIZE. Lower it to check small inputs split.  */
+	void SetParallelMinSize (size_t size) { parallelMinSize = size; }
+
+	SymbolTable symbols;
+	SourceBuffer source;
+	LumaLexer lexer;
+	vector<Pattern*> patterns;  /* top-level and nested, in source order */
+	vector<unsigned char> channels;  /* the MIDI channel of each of those */
+	size_t channelStart;  /* first pattern of the line being parsed */
+	vector<TempoChange> tempoChanges;
+	deque<ScaleInfo> scales;  /* defined by the song, deque keeps them in place */
+	ScaleInfo newScale;       /* the one being defined */
+	unsigned numThreads;
+	size_t parallelMinSize;
+	bool silent;  /* do not report errors */
+
+private:
+	int ParseChunk (const char *begin, const char *end, int firstLine);
+	int ParseParallel (const char *text, size_t size);
+};
 
 %}
 
+%define api.pure
+%locations
+%parse-param {ParseContext *ctx}
+%lex-param {ParseContext *ctx}
+
 %union {
 	int val; /* for numbers */
 	symrec* tptr; /* for symbol table pointers */
 	Note* note;
 	Pattern* pat;
 }
+%{
+int yylex (YYSTYPE *lvalp, YYLTYPE *llocp, ParseContext *ctx);
+void yyerror (YYLTYPE *llocp, ParseContext *ctx, char const *);
+%}
+
 %token <val> NUM
-%token <tptr> VAR FNCT SCALE
+%token <tptr> VAR FNCT SCALE TEMPO SCALEDEF
 %type <note> noteexp;
 %type <note> rest;
 %type <pat> patseq;
 %type <pat> pattern;
+%type <tptr> scalename;
+%type <val> channel;
 
-%expect 1
+/* Notes and patterns dropped by a syntax error. A finished pattern is in
+   ctx->patterns already and goes to the song with the rest.  */
+%destructor { delete $$; } <note>
+%destructor { delete $$; } patseq
 
 %% 
 
@@ -61,6 +104,79 @@ input:    /* empty */
 
 line:     '\n'
 	 | pattern '\n'
+	 | channel pattern '\n'
+{
+	for (size_t i = ctx->channelStart; i < ctx->patterns.size (); i++) {
+		ctx->channels[i] = (unsigned char)$1;
+	}
+}
+	 | tempo '\n'
+	 | scaledef '\n'
+;
+
+/* N: before a pattern plays it on MIDI channel N, 1 to 16, so it reaches
+   the instruments listening there. Other patterns play on channel 1.  */
+channel: NUM ':'
+{
+	if ($1 < 1 || $1 > MIDI_CHANNELS) {
+		yyerror (&@1, ctx, "MIDI channels are 1 to 16");
+		YYERROR;
+	}
+	ctx->channelStart = ctx->patterns.size ();
+	$$ = $1 - 1;
+}
+;
+
+/* scale_NAME = [I1, I2, ...] defines a scale by the semitones of its
+   degrees above C, or replaces the one called NAME from here on.  */
+scaledef: SCALEDEF '_' scalename '=' '[' intervals ']'
+{
+	/* a new symbol rather than $3, which may be in a shared base table */
+	ctx->scales.push_back (ctx->newScale);
+	symrec *sym = ctx->symbols.Define (string_view ($3->name, $3->length), $3->hash, SCALE);
+	sym->value.scale = &ctx->scales.back ();
+	sym->line = @1.first_line;
+	sym->replaced = $3->type == SCALE ? $3 : NULL;
+}
+;
+
+scalename: VAR | SCALE;
+
+intervals: NUM
+{
+	if (!IsMidiPitch ($1)) {
+		yyerror (&@1, ctx, "scale intervals are 0 to 127 semitones");
+		YYERROR;
+	}
+	ctx->newScale.numIntervals = 1;
+	ctx->newScale.intervals[0] = (unsigned char)$1;
+} |
+	intervals ',' NUM
+{
+	if (ctx->newScale.numIntervals >= 12) {
+		yyerror (&@3, ctx, "a scale has at most 12 degrees");
+		YYERROR;
+	}
+	if (!IsMidiPitch ($3)) {
+		yyerror (&@3, ctx, "scale intervals are 0 to 127 semitones");
+		YYERROR;
+	}
+	ctx->newScale.intervals[ctx->newScale.numIntervals++] = (unsigned char)$3;
+}
+;
+
+/* tempo_BPM sets the tempo of the whole song, tempo_BPM_BEAT changes it
+   from that beat on.  */
+tempo:	TEMPO '_' NUM
+{
+	TempoChange change = { 0, (float)$3 };
+	ctx->tempoChanges.push_back (change);
+} |
+	TEMPO '_' NUM '_' NUM
+{
+	TempoChange change = { $5, (float)$3 };
+	ctx->tempoChanges.push_back (change);
+}
 ;
 
 rest:	'_' NUM 
@@ -73,35 +189,50 @@ rest:	'_' NUM
 noteexp:  
 	SCALE'_'NUM'_'NUM'_'NUM'_'NUM
 	{
-		Scale scale = $1->value.scale;
+		const ScaleInfo *scale = $1->value.scale;
 		int octave = $3;
 		int degree = $5;
 		int velocity = $7;
 		int length = $9;
-		//printf("Scale: %d Octave: %d Degree: %d\n", scale, octave, degree); 
-		Note* n = new Note(scale, octave, degree, velocity, length);
+		//printf("Octave: %d Degree: %d\n", octave, degree); 
+		int pitch = GetMidiPitch(scale, octave, degree);
+		if (!IsMidiPitch(pitch)) {
+			yyerror (&@3, ctx, "the note is outside the MIDI range of 0 to 127");
+			YYERROR;
+		}
+		Note* n = new Note((unsigned char)pitch, velocity, length);
 		$$ = n;
 	} |
 	SCALE'_'NUM'_'NUM
 	{
-		Scale scale = $1->value.scale;
+		const ScaleInfo *scale = $1->value.scale;
 		int octave = $3;
 		int degree = $5;
 		int velocity = 100;
 		int length = 4;
-		//printf("Scale: %d Octave: %d Degree: %d\n", scale, octave, degree); 
-		Note* n = new Note(scale, octave, degree, velocity, length);
+		//printf("Octave: %d Degree: %d\n", octave, degree); 
+		int pitch = GetMidiPitch(scale, octave, degree);
+		if (!IsMidiPitch(pitch)) {
+			yyerror (&@3, ctx, "the note is outside the MIDI range of 0 to 127");
+			YYERROR;
+		}
+		Note* n = new Note((unsigned char)pitch, velocity, length);
 		$$ = n;
 	} |
 	SCALE'_'NUM'_'NUM'_'NUM
 	{
-		Scale scale = $1->value.scale;
+		const ScaleInfo *scale = $1->value.scale;
 		int octave = $3;
 		int degree = $5;
 		int velocity = $7;
 		int length = 4;
-		//printf("Scale: %d Octave: %d Degree: %d\n", scale, octave, degree); 
-		Note* n = new Note(scale, octave, degree, velocity, length);
+		//printf("Octave: %d Degree: %d\n", octave, degree); 
+		int pitch = GetMidiPitch(scale, octave, degree);
+		if (!IsMidiPitch(pitch)) {
+			yyerror (&@3, ctx, "the note is outside the MIDI range of 0 to 127");
+			YYERROR;
+		}
+		Note* n = new Note((unsigned char)pitch, velocity, length);
 		$$ = n;
 	};
 
@@ -124,12 +255,20 @@ patseq:
 		p->Add($1);
 		$$ = p; 
 	} |
-	patseq','patseq 
+	patseq','noteexp 
 	{
-		Pattern* p = new Pattern;
-		p->Add($1);
-		p->Add($3);
-		$$ = p;
+		$1->Add($3);
+		$$ = $1;
+	} |
+	patseq','pattern 
+	{
+		$1->Add($3);
+		$$ = $1;
+	} |
+	patseq','rest 
+	{
+		$1->Add($3);
+		$$ = $1;
 	}
 ;
 
@@ -138,14 +277,16 @@ pattern:
 	{
 		$$ = $2;
 		$2->SetRepeatCount(1);
-		song.AddPattern($2);
+		ctx->patterns.push_back($2);
+		ctx->channels.push_back(0);
 		//$2->Print();
 	} |
 	'[' patseq ']' '#' NUM
 	{
 		$$ = $2;
 		$2->SetRepeatCount($5);
-		song.AddPattern($2);
+		ctx->patterns.push_back($2);
+		ctx->channels.push_back(0);
 		//$2->Print();
 	}
 ;
@@ -167,98 +308,233 @@ void print_sym_type(symrec* sym)
 	printf("\n");
 }
 
-ifstream is;
-
-int yylex (void)
+int yylex (YYSTYPE *lvalp, YYLTYPE *llocp, ParseContext *ctx)
 {
-	int c;
+	LexToken token;
+	ctx->lexer.Next(token);
 
-	do {
-		c = is.get();
-	} while (c == ' ' || c == '\t');
+	llocp->first_line = llocp->last_line = token.line;
+	llocp->first_column = token.column;
+	llocp->last_column = token.column + (int)token.text.size();
 
-	if (!is.good()) {
+	switch (token.type)
+	{
+	case LEX_END:
 		return 0;
-	}
 
-	// Char starts a number => parse the number. 
-	if (c == '.' || isdigit (c))
-	{
-		is.unget();
-		is >> c;
-		yylval.val = c;
-		//cout << "Token Num: " << c << endl;
+	case LEX_NUMBER:
+		lvalp->val = token.value;
 		return NUM;
-	}
-
-	// Char starts an identifier => read the name.
-	if (isalpha (c))
-	{
-		symrec *s;
-		static char *symbuf = 0;
-		static int length = 0;
-		int i;
-
-		// Initially make the buffer long enough for a 40-character symbol name.
-		if (length == 0) {
-			length = 40;
-			symbuf = (char *)malloc (length + 1);
-		}
 
-		i = 0;
-		do
-		{
-			// If buffer is full, make it bigger.
-			if (i == length)
-			{
-				length *= 2;
-				symbuf = (char *) realloc (symbuf, length + 1);
-			}
-			// Add this character to the buffer
-			symbuf[i++] = c;
-			// Get another character
-			c = is.get();
-		}
-		while (isalnum (c));
+	case LEX_INVALID:
+		/* reported here, YYerror stops the parse without a second message */
+		yyerror (llocp, ctx, token.error);
+		return YYerror;
 
-		is.unget();
-		symbuf[i] = '\0';
-
-		s = getsym (symbuf);
+	case LEX_IDENTIFIER:
+	{
+		symrec *s = ctx->symbols.Lookup (token.text, token.hash);
 		if (s == 0) {
-			s = putsym (symbuf, VAR);
-			//cout << "Adding new symbol: " << s << endl;
+			s = ctx->symbols.Define (token.text, token.hash, VAR);
 		}
-		yylval.tptr = s;
-		//cout << "Token symbol: " << s->name << endl;
-		//print_sym_type(s);
+		lvalp->tptr = s;
 		return s->type;
 	}
-
-	//cout << "Token: " << (char)c << endl;
+	}
 
 	// Any other character is a token by itself
-	return c;
- }
-
-/* The symbol table: a chain of `struct symrec'.  */
-symrec *sym_table;
+	return token.type;
+}
 
  /* Put arithmetic functions in table.  */
-void init_table (void)
+void init_table (SymbolTable &symbols)
 {
 	int i;
 	symrec *ptr;
-	for (i = 0; i < NumScales; i++)
+	for (i = 0; i < NUM_BUILTIN_SCALES; i++)
+	{
+		int root = i / NUM_MODES;
+		int mode = i % NUM_MODES;
+		ptr = symbols.Define (string (rootNames[root]) + modeInfo[mode].name, SCALE);
+		ptr->value.scale = &builtinScales.scales[i];
+		if (flatRootNames[root]) {
+			ptr = symbols.Define (string (flatRootNames[root]) + modeInfo[mode].name, SCALE);
+			ptr->value.scale = &builtinScales.scales[i];
+		}
+	}
+	symbols.Define ("scale", SCALEDEF);
+	symbols.Define ("tempo", TEMPO);
+}
+
+ParseContext::ParseContext ()
+: channelStart (0), numThreads (1), parallelMinSize (PARALLEL_PARSE_MIN_SIZE), silent (false)
+{
+	init_table (symbols);
+}
+
+ParseContext::ParseContext (ParseContext *shared, int firstLine)
+: channelStart (0), numThreads (1), parallelMinSize (PARALLEL_PARSE_MIN_SIZE), silent (false)
+{
+	symbols.SetBase (&shared->symbols, firstLine);
+}
+
+// Parse a luma source file into the song. Returns the yyparse result, or
+// -1 if the file could not be opened.
+int ParseContext::ParseFile (const char *fileName, Song *target)
+{
+	if (!source.Open (fileName)) {
+		fprintf (stderr, "Could not open %s\n", fileName);
+		return -1;
+	}
+	int ret = ParseText (source.GetData(), source.GetSize(), target);
+	source.Close ();
+	return ret;
+}
+
+// Parse luma source that is already in memory into the song
+int ParseContext::ParseText (const char *text, size_t size, Song *target)
+{
+	patterns.clear ();
+	channels.clear ();
+	tempoChanges.clear ();
+	int ret;
+	if (numThreads > 1 && size >= parallelMinSize) {
+		ret = ParseParallel (text, size);
+	}
+	else {
+		ret = ParseChunk (text, text + size, 1);
+	}
+
+	target->ReservePatterns (patterns.size ());
+	for (size_t i = 0; i < patterns.size (); i++) {
+		target->AddPattern (patterns[i], channels[i]);
+	}
+	patterns.clear ();
+	channels.clear ();
+	for (size_t i = 0; i < tempoChanges.size (); i++) {
+		target->AddTempoChange (tempoChanges[i].beat, tempoChanges[i].bpm);
+	}
+	tempoChanges.clear ();
+	return ret;
+}
+
+int ParseContext::ParseChunk (const char *begin, const char *end, int firstLine)
+{
+	lexer.Start (begin, end, firstLine);
+	return yyparse (this);
+}
+
+// Every top-level line is a pattern of its own, so the input can be cut at
+// any newline outside brackets and the pieces parsed independently. Each
+// chunk gets its own context, and the patterns are gathered back in chunk
+// order so the song is the same as a serial parse. The scale definitions
+// are parsed into this context first, once, and the chunks look them and
+// the builtins up there.
+int ParseContext::ParseParallel (const char *text, size_t size)
+{
+	struct Chunk
 	{
-		ptr = putsym (scaleInfo[i].Name, SCALE);
-		ptr->value.scale = (Scale)i;
+		const char *begin;
+		const char *end;
+		int firstLine;
+	};
+
+	// a few chunks per thread so an uneven chunk does not hold up the rest
+	size_t numChunks = numThreads * 4;
+	size_t targetSize = size / numChunks + 1;
+	vector<Chunk> chunks;
+	chunks.reserve (numChunks + 1);
+	// scale definition lines, which every later chunk needs to know about
+	vector<Chunk> scaleDefs;
+
+	const char *end = text + size;
+	const char *chunkStart = text;
+	const char *lineStart = text;
+	int chunkLine = 1;
+	int line = 1;
+	int depth = 0;
+	for (const char *p = text; p < end; p++) {
+		char c = *p;
+		if (c == '[') {
+			depth++;
+		}
+		else if (c == ']') {
+			depth = depth > 0 ? depth - 1 : 0;
+		}
+		else if (c == '\n') {
+			const char *first = lineStart;
+			while (first < p && (*first == ' ' || *first == '\t')) {
+				first++;
+			}
+			if (depth == 0 && p - first > 6 && strncmp (first, "scale_", 6) == 0) {
+				Chunk def = { lineStart, p + 1, line };
+				scaleDefs.push_back (def);
+			}
+			lineStart = p + 1;
+			line++;
+			if (depth == 0 && (size_t)(p + 1 - chunkStart) >= targetSize) {
+				Chunk chunk = { chunkStart, p + 1, chunkLine };
+				chunks.push_back (chunk);
+				chunkStart = p + 1;
+				chunkLine = line;
+			}
+		}
+	}
+	if (chunkStart < end) {
+		Chunk chunk = { chunkStart, end, chunkLine };
+		chunks.push_back (chunk);
+	}
+
+	// their errors are reported by the chunk they are in
+	silent = true;
+	for (size_t d = 0; d < scaleDefs.size (); d++) {
+		ParseChunk (scaleDefs[d].begin, scaleDefs[d].end, scaleDefs[d].firstLine);
 	}
+	silent = false;
+
+	vector<ParseContext*> contexts (chunks.size ());
+	vector<int> results (chunks.size (), 0);
+	atomic<size_t> nextChunk (0);
+	unsigned numWorkers = numThreads < chunks.size () ? numThreads : (unsigned)chunks.size ();
+
+	vector<thread> workers;
+	workers.reserve (numWorkers);
+	for (unsigned w = 0; w < numWorkers; w++) {
+		workers.push_back (thread ([&] () {
+			size_t i;
+			while ((i = nextChunk.fetch_add (1)) < chunks.size ()) {
+				ParseContext *ctx = new ParseContext (this, chunks[i].firstLine);
+				results[i] = ctx->ParseChunk (chunks[i].begin, chunks[i].end, chunks[i].firstLine);
+				contexts[i] = ctx;
+			}
+		}));
+	}
+	for (size_t w = 0; w < workers.size (); w++) {
+		workers[w].join ();
+	}
+
+	int ret = 0;
+	size_t numPatterns = 0;
+	for (size_t i = 0; i < contexts.size (); i++) {
+		numPatterns += contexts[i]->patterns.size ();
+	}
+	patterns.reserve (numPatterns);
+	channels.reserve (numPatterns);
+	for (size_t i = 0; i < contexts.size (); i++) {
+		patterns.insert (patterns.end (), contexts[i]->patterns.begin (), contexts[i]->patterns.end ());
+		channels.insert (channels.end (), contexts[i]->channels.begin (), contexts[i]->channels.end ());
+		tempoChanges.insert (tempoChanges.end (), contexts[i]->tempoChanges.begin (), contexts[i]->tempoChanges.end ());
+		if (ret == 0) {
+			ret = results[i];
+		}
+		delete contexts[i];
+	}
+	return ret;
 }
 
 /*int main (int argc, char** argv)
 {
-	init_table();
+	init_table(sym_table);
 
 	is.open("C:\\Documents and Settings\\George\\My Documents\\luma2\\input.txt", ifis::in);
 	int ret = yyparse();
@@ -268,32 +544,10 @@ void init_table (void)
 }*/
 
  /* Called by yyparse on error.  */
- void yyerror (char const *s)
- {
-   fprintf (stderr, "%s\n", s);
- }
-
-symrec * putsym (char const *sym_name, int sym_type)
- {
-   symrec *ptr;
-   ptr = (symrec *) malloc (sizeof (symrec));
-   ptr->name = (char *) malloc (strlen (sym_name) + 1);
-   strcpy (ptr->name,sym_name);
-   ptr->type = sym_type;
-   ptr->value.var = 0; /* Set value to 0 even if fctn.  */
-   ptr->next = (struct symrec *)sym_table;
-   sym_table = ptr;
-   return ptr;
- }
-
- symrec * getsym (char const *sym_name)
+ void yyerror (YYLTYPE *llocp, ParseContext *ctx, char const *s)
  {
-   symrec *ptr;
-   for (ptr = sym_table; ptr != (symrec *) 0;
-		ptr = (symrec *)ptr->next)
-	 if (strcmp (ptr->name,sym_name) == 0)
-	   return ptr;
-   return 0;
+   if (!ctx->silent)
+     fprintf (stderr, "%d:%d: %s\n", llocp->first_line, llocp->first_column, s);
  }
 
 #endif
\ No newline at end of file
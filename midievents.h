@@ -0,0 +1,170 @@
+#ifndef MIDIEVENTS_H
+#define MIDIEVENTS_H
+
+#include <string.h>
+#include "pluginterfaces/vst2.x/aeffectx.h"
+#include "timeline.h"
+
+static const int VST_MAX_EVENTS = 512;
+
+//-------------------------------------------------------------------------------------------------------
+// MidiEventBatch
+//-------------------------------------------------------------------------------------------------------
+// Collects every MIDI event of a block so they reach the plugin in a single
+// effProcessEvents call. All storage is part of the struct, nothing is
+// allocated while playing.
+struct MidiEventBatch
+{
+	// past VST_MAX_EVENTS, one all notes off per channel for note offs
+	// that did not fit
+	VstMidiEvent pool[VST_MAX_EVENTS + MIDI_CHANNELS];
+	// VstEvents ends in a two entry array, so reserve room for all the pointers
+	union
+	{
+		VstEvents header;
+		char headerStorage[sizeof(VstEvents) + (VST_MAX_EVENTS + MIDI_CHANNELS) * sizeof(VstEvent*)];
+	};
+	int numEvents;
+	unsigned long numDropped;
+	// channels with an all notes off waiting, one bit each
+	unsigned int allNotesOffChannels;
+
+	MidiEventBatch ()
+	: numEvents (0), numDropped (0), allNotesOffChannels (0)
+	{
+		header.numEvents = 0;
+		header.reserved = 0;
+	}
+
+	// Returns the event to fill in, or NULL if the batch is full. A full batch
+	// makes room for a note off by dropping the latest note on. With no note
+	// on left to drop, the caller falls back on allNotesOff, so an overflow
+	// can lose notes but never leaves one hanging.
+	VstMidiEvent* add (bool noteOff)
+	{
+		if (numEvents < VST_MAX_EVENTS)
+			return &pool[numEvents++];
+
+		numDropped++;
+		if (noteOff)
+		{
+			for (int i = numEvents - 1; i >= 0; i--)
+			{
+				if ((pool[i].midiData[0] & 0xF0) == MIDI_NOTE_ON)
+				{
+					// keep the batch in the order events were added
+					for (int j = i; j < numEvents - 1; j++)
+						pool[j] = pool[j + 1];
+					return &pool[numEvents - 1];
+				}
+			}
+		}
+		return NULL;
+	}
+
+	// Stands in for note offs on a channel that did not fit. The channel
+	// gets one all notes off (CC 123) at the latest of their offsets, sent
+	// ahead of the other events at that frame so notes struck there live.
+	void allNotesOff (int offset, int channel)
+	{
+		VstMidiEvent* event = &pool[VST_MAX_EVENTS + channel];
+		if (allNotesOffChannels & (1u << channel))
+		{
+			if (offset > event->deltaFrames)
+				event->deltaFrames = offset;
+			return;
+		}
+		allNotesOffChannels |= 1u << channel;
+		memset (event, 0, sizeof (VstMidiEvent));
+		event->type = kVstMidiType;
+		event->byteSize = sizeof (VstMidiEvent);
+		event->deltaFrames = offset;
+		event->midiData[0] = (char)(MIDI_CONTROL_CHANGE | channel);
+		event->midiData[1] = (char)MIDI_ALL_NOTES_OFF;
+	}
+
+	// Sends the batch to the plugin sorted by deltaFrames and empties it
+	void dispatch (AEffect* effect)
+	{
+		VstEvent* allOff[MIDI_CHANNELS];
+		int numAllNotesOff = 0;
+		for (int c = 0; c < MIDI_CHANNELS; c++)
+		{
+			if (allNotesOffChannels & (1u << c))
+				allOff[numAllNotesOff++] = (VstEvent*)&pool[VST_MAX_EVENTS + c];
+		}
+		int total = numAllNotesOff + numEvents;
+		if (total == 0)
+			return;
+
+		// insertion sort keeps events at the same frame in the order they were
+		// added, and the timeline already hands them over nearly sorted. The
+		// all notes offs go in first, so they come before anything at their
+		// frame.
+		for (int i = 0; i < total; i++)
+		{
+			VstEvent* e = i < numAllNotesOff ? allOff[i] : (VstEvent*)&pool[i - numAllNotesOff];
+			int j = i;
+			while (j > 0 && header.events[j - 1]->deltaFrames > e->deltaFrames)
+			{
+				header.events[j] = header.events[j - 1];
+				j--;
+			}
+			header.events[j] = e;
+		}
+		header.numEvents = total;
+
+		effect->dispatcher (effect, effProcessEvents, 0, 0, &header, 0);
+
+		header.numEvents = 0;
+		numEvents = 0;
+		allNotesOffChannels = 0;
+	}
+};
+
+void PlayNoteOn(MidiEventBatch& batch, int offset, short pitch, short velocity, int length, int channel = 0)
+{
+	VstMidiEvent* event = batch.add(false);
+	if (!event) {
+		return;
+	}
+	event->type = kVstMidiType;
+	event->byteSize = sizeof(VstMidiEvent);
+	event->deltaFrames = offset;	///< sample frames related to the current block start sample position
+	event->flags = 0;			///< @see VstMidiEventFlags
+	event->noteLength = length;	///< (in sample frames) of entire note, if available, else 0
+	event->noteOffset = 0;	///< offset (in sample frames) into note from note start if available, else 0
+	event->midiData[0] = (char)(MIDI_NOTE_ON | channel);
+	event->midiData[1] = (char)pitch;
+	event->midiData[2] = (char)velocity;
+	event->midiData[3] = 0;
+	event->detune = 0;			///< -64 to +63 cents; for scales other than 'well-tempered' ('microtuning')
+	event->noteOffVelocity = 0;	///< Note Off Velocity [0, 127]
+	event->reserved1 = 0;
+	event->reserved2 = 0;
+}
+
+void PlayNoteOff(MidiEventBatch& batch, int offset, short pitch, int channel = 0)
+{
+	VstMidiEvent* event = batch.add(true);
+	if (!event) {
+		batch.allNotesOff(offset, channel);
+		return;
+	}
+	event->type = kVstMidiType;
+	event->byteSize = sizeof(VstMidiEvent);
+	event->deltaFrames = offset;	///< sample frames related to the current block start sample position
+	event->flags = 0;			///< @see VstMidiEventFlags
+	event->noteLength = 0;	///< (in sample frames) of entire note, if available, else 0
+	event->noteOffset = 0;	///< offset (in sample frames) into note from note start if available, else 0
+	event->midiData[0] = (char)(MIDI_NOTE_OFF | channel);
+	event->midiData[1] = (char)pitch;
+	event->midiData[2] = (char)0;
+	event->midiData[3] = 0;
+	event->detune = 0;			///< -64 to +63 cents; for scales other than 'well-tempered' ('microtuning')
+	event->noteOffVelocity = 0;	///< Note Off Velocity [0, 127]
+	event->reserved1 = 0;
+	event->reserved2 = 0;
+}
+
+#endif
@@ -14,215 +14,51 @@
 #define MINIHOST_H
 
 #include "pluginterfaces/vst2.x/aeffectx.h"
-#include "portaudio.h"
 
 #if _WIN32
 #include <windows.h>
 #elif TARGET_API_MAC_CARBON
 #include <CoreFoundation/CoreFoundation.h>
+#else
+#include <dlfcn.h>
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include "lumagrammar.h"
 #include "music.h"
+#include "logring.h"
+#include "songcache.h"
+#include "transport.h"
+#include "synth.h"
+#include "audiobackend.h"
+#include "plugincache.h"
+#include "midievents.h"
+#include "graph.h"
+#include "telemetry.h"
 #include <vector>
 #include <string>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
 
-extern Song song;
 struct PluginLoader;
 
 using namespace std;
 
+// defaults, see Session::SetAudioFormat
 static const double AUDIO_SAMPLE_RATE = 44100;
 static const int AUDIO_OUTPUT_CHANNELS = 2;
 static const unsigned long AUDIO_FRAMES_PER_BUFFER = 512;
-static const int VST_MAX_EVENTS = 512;
-
-PaStream *stream = NULL;
-AEffect* effect = NULL;
-VstEvents* vstEvents = NULL;
-bool audioStarted = false;
-PluginLoader* pluginLoader = NULL;
-
-VstMidiEvent globalEvent;
-
-static const unsigned int VST_MAX_OUTPUT_CHANNELS_SUPPORTED = 2;
-static float** vstOutputBuffer = NULL;
-
-void PlayNoteOn(AEffect* effect, float offset, short pitch, short velocity, short length)
-{
-	globalEvent.type = kVstMidiType;
-	globalEvent.byteSize = sizeof(VstMidiEvent);
-	globalEvent.deltaFrames = offset;	///< sample frames related to the current block start sample position
-	globalEvent.flags = 0;			///< @see VstMidiEventFlags
-	globalEvent.noteLength = length;	///< (in sample frames) of entire note, if available, else 0
-	globalEvent.noteOffset = 0;	///< offset (in sample frames) into note from note start if available, else 0
-	globalEvent.midiData[0] = (char)0x90;
-	globalEvent.midiData[1] = (char)pitch;
-	globalEvent.midiData[2] = (char)velocity;
-	globalEvent.detune = 0;			///< -64 to +63 cents; for scales other than 'well-tempered' ('microtuning')
-	globalEvent.noteOffVelocity = 0;	///< Note Off Velocity [0, 127]
-	
-	vstEvents->numEvents = 1;
-	vstEvents->events[0] = (VstEvent*)&globalEvent;
-	
-	effect->dispatcher( effect, effProcessEvents, 0, 0, vstEvents, 0);
-
-	//vstEvents->numEvents = 0;
-
-	//printf("play note on\n");
-}
-
-void PlayNoteOff(AEffect* effect, float offset, short pitch)
-{
-	globalEvent.type = kVstMidiType;
-	globalEvent.byteSize = sizeof(VstMidiEvent);
-	globalEvent.deltaFrames = offset;	///< sample frames related to the current block start sample position
-	globalEvent.flags = 0;			///< @see VstMidiEventFlags
-	globalEvent.noteLength = 0;	///< (in sample frames) of entire note, if available, else 0
-	globalEvent.noteOffset = 0;	///< offset (in sample frames) into note from note start if available, else 0
-	globalEvent.midiData[0] = (char)0x80;
-	globalEvent.midiData[1] = (char)pitch;
-	globalEvent.midiData[2] = (char)0;
-	globalEvent.detune = 0;			///< -64 to +63 cents; for scales other than 'well-tempered' ('microtuning')
-	globalEvent.noteOffVelocity = 0;	///< Note Off Velocity [0, 127]
-	
-	vstEvents->numEvents = 1;
-	vstEvents->events[0] = (VstEvent*)&globalEvent;
-	
-	effect->dispatcher( effect, effProcessEvents, 0, 0, vstEvents, 0);
-
-	//vstEvents->numEvents = 0;
-
-	//printf("play note off\n");
-}
-
-vector<Event> songEvents;
-vector<float> songOffsets;
-
-/* This routine will be called by the PortAudio engine when audio is needed.
-** It may called at interrupt level on some machines so don't do anything
-** that could mess up the system like calling malloc() or free().
-*/
-static int portaudioCallback( const void *inputBuffer, void *outputBuffer,
-                            unsigned long framesPerBuffer,
-                            const PaStreamCallbackTimeInfo* timeInfo,
-                            PaStreamCallbackFlags statusFlags,
-                            void *userData )
-{
-    (void) inputBuffer; /* Prevent "unused variable" warnings. */
-
-	float timeElapsedInMs = framesPerBuffer / AUDIO_SAMPLE_RATE * 1000;
-
-	VstInt32 numOutputs = effect->numOutputs;
-	
-	float** vstOut = (float**)vstOutputBuffer;
-	effect->processReplacing (effect, NULL, vstOut, framesPerBuffer);
-
-	float *out = (float*)outputBuffer;
-	for (unsigned long i=0; i<framesPerBuffer; i++) {
-		*out++ = vstOutputBuffer[0][i];
-		*out++ = vstOutputBuffer[1][i];
-	}
-
-	// Process events
-	song.Update(timeElapsedInMs, songEvents, songOffsets);
-	for (int j=0; j<songEvents.size(); j++) {
-		Event* e = &songEvents[j];
-		float offset = songOffsets[j];
-		Note* note = e->note;
-		int offsetInSamples = offset / 1000 * AUDIO_SAMPLE_RATE;
-		if (note->IsNoteOff()) {
-			cout << "Note off " << offset << " " << offsetInSamples << endl;
-			PlayNoteOff(effect, offsetInSamples, note->GetPitch());
-		}
-		else {
-			cout << "Note on " << offset << " " << offsetInSamples << endl;
-			note->Print();
-			cout << endl;
-			int noteLengthInSamples = note->GetLengthInMs() / 1000 * AUDIO_SAMPLE_RATE;
-			PlayNoteOn(effect, offsetInSamples, note->GetPitch(), note->GetVelocity(), noteLengthInSamples);
-		}
-	}
-	songEvents.clear();
-	songOffsets.clear();
-	// End process events
-	
-    return 0;
-}
-
-void HandleAudioError(PaError err)
-{
-	// print error info here
-	cout << "Audio failed to start. Error code: " << err << endl;
-}
-
-bool StartAudio()
-{
-	PaStreamParameters outputParameters;
-    PaError err;
-    
-	// init buffer used in callback to retrieve data from plugin
-	vstOutputBuffer = new float*[VST_MAX_OUTPUT_CHANNELS_SUPPORTED];
-	for (int i=0; i<VST_MAX_OUTPUT_CHANNELS_SUPPORTED; i++) {
-		vstOutputBuffer[i] = new float[AUDIO_FRAMES_PER_BUFFER];
-	}
-
-	err = Pa_Initialize();
-	if( err != paNoError ) {
-		HandleAudioError(err); 
-		return false;
-	}
-    
-    outputParameters.device = Pa_GetDefaultOutputDevice(); /* default output device */
-    if (outputParameters.device == paNoDevice) {
-      fprintf(stderr,"Error: No default output device.\n");
-      HandleAudioError(err); return false;
-    }
-
-    outputParameters.channelCount = AUDIO_OUTPUT_CHANNELS;
-    outputParameters.sampleFormat = paFloat32;
-    outputParameters.suggestedLatency = Pa_GetDeviceInfo( outputParameters.device )->defaultLowOutputLatency;
-    outputParameters.hostApiSpecificStreamInfo = NULL;
-    err = Pa_OpenStream(
-              &stream,
-              NULL, /* no input */
-              &outputParameters,
-              AUDIO_SAMPLE_RATE,
-              AUDIO_FRAMES_PER_BUFFER,
-              (paClipOff | paDitherOff),
-              portaudioCallback,
-              NULL );
-    if( err != paNoError ) {
-		HandleAudioError(err);
-		return false;
-	}
-
-    err = Pa_StartStream( stream );
-    if( err != paNoError ) {
-		HandleAudioError(err); 
-		return false;
-	}
-
-	audioStarted = true;
-
-    return true;
-}
-
-bool StopAudio()
-{
-	PaError err = Pa_CloseStream( stream );
-    if( err != paNoError ) {
-		HandleAudioError(err); 
-		return false;
-	}
-    Pa_Terminate();
-
-	audioStarted = false;
 
-	return true;
-}
+// plugins with more outputs than the graph's channels are mixed down to them
+static const int VST_MAX_OUTPUT_CHANNELS_SUPPORTED = 64;
 
 //-------------------------------------------------------------------------------------------------------
 typedef AEffect* (*PluginEntryProc) (audioMasterCallback audioMaster);
@@ -249,6 +85,8 @@ struct PluginLoader
 		#elif TARGET_API_MAC_CARBON
 			CFBundleUnloadExecutable ((CFBundleRef)module);
 			CFRelease ((CFBundleRef)module);
+		#else
+			dlclose (module);
 		#endif
 		}
 	}
@@ -269,6 +107,10 @@ struct PluginLoader
 		CFRelease (url);
 		if (module && CFBundleLoadExecutable ((CFBundleRef)module) == false)
 			return false;
+	#else
+		module = dlopen (fileName, RTLD_NOW | RTLD_LOCAL);
+		if (!module)
+			printf ("%s\n", dlerror ());
 	#endif
 		return module != 0;
 	}
@@ -284,6 +126,10 @@ struct PluginLoader
 		mainProc = (PluginEntryProc)CFBundleGetFunctionPointerForName ((CFBundleRef)module, CFSTR("VSTPluginMain"));
 		if (!mainProc)
 			mainProc = (PluginEntryProc)CFBundleGetFunctionPointerForName ((CFBundleRef)module, CFSTR("main_macho"));
+	#else
+		mainProc = (PluginEntryProc)dlsym (module, "VSTPluginMain");
+		if (!mainProc)
+			mainProc = (PluginEntryProc)dlsym (module, "main");
 	#endif
 		return mainProc;
 	}
@@ -291,7 +137,7 @@ struct PluginLoader
 };
 
 //-------------------------------------------------------------------------------------------------------
-static bool checkPlatform ()
+inline bool checkPlatform ()
 {
 #if VST_64BIT_PLATFORM
 	printf ("*** This is a 64 Bit Build! ***\n");
@@ -311,82 +157,1210 @@ static bool checkPlatform ()
 }
 
 //-------------------------------------------------------------------------------------------------------
-static void checkEffectProperties (AEffect* effect);
-static void checkEffectProcessing (AEffect* effect);
+static void gatherEffectProperties (AEffect* effect, PluginInfo& info);
+static void printEffectProperties (const PluginInfo& info);
 extern bool checkEffectEditor (AEffect* effect); // minieditor.cpp
 
-void Cleanup()
+#if _WIN32
+static const char* DEFAULT_PLUGIN_PATH = "C:\\Program Files\\VSTPlugins\\Circle.dll";
+#else
+static const char* DEFAULT_PLUGIN_PATH = "Circle"; // looked for on the plugin search path
+#endif
+
+//-------------------------------------------------------------------------------------------------------
+// Info on every plugin on the search path. Plugins the cache knows about
+// are not loaded at all, the others are instantiated once to be scanned
+// and added to it. Returns how many had to be scanned.
+//-------------------------------------------------------------------------------------------------------
+inline size_t scanPlugins (const PluginSearchPath& searchPath, PluginInfoCache& cache, vector<PluginInfo>& plugins)
 {
-	if (audioStarted) {
-		StopAudio();
+	vector<string> paths;
+	searchPath.List (paths);
+	size_t numScanned = 0;
+	for (size_t i = 0; i < paths.size (); i++)
+	{
+		if (const PluginInfo* cached = cache.Find (paths[i]))
+		{
+			plugins.push_back (*cached);
+			continue;
+		}
+
+		PluginLoader loader;
+		if (!loader.loadLibrary (paths[i].c_str ()))
+			continue;
+		PluginEntryProc mainEntry = loader.getMainEntry ();
+		AEffect* effect = mainEntry ? mainEntry (HostCallback) : 0;
+		if (!effect || effect->magic != kEffectMagic)
+			continue;
+
+		PluginInfo info;
+		info.path = paths[i];
+		effect->dispatcher (effect, effOpen, 0, 0, 0, 0);
+		gatherEffectProperties (effect, info);
+		effect->dispatcher (effect, effClose, 0, 0, 0, 0);
+		cache.Store (info);
+		plugins.push_back (info);
+		numScanned++;
 	}
+	return numScanned;
+}
 
-	printf ("HOST> Suspend effect...\n");
-	effect->dispatcher (effect, effMainsChanged, 0, 0, 0, 0);
+//-------------------------------------------------------------------------------------------------------
+// Session
+//-------------------------------------------------------------------------------------------------------
+// One song from source to sound: its parser, the song and its compiled
+// timeline, the graph of plugins it plays through and everything the
+// audio path needs. Sessions share nothing, so any number of them can parse and
+// render at once, each on its own thread.
+class Session
+{
+public:
+	Session();
+	~Session();
+
+	// Sample rate and block size the session runs at, AUDIO_SAMPLE_RATE and
+	// AUDIO_FRAMES_PER_BUFFER unless set. Set before loading the song and
+	// the plugin, and not while audio runs.
+	void SetAudioFormat(double sampleRate, unsigned long framesPerBuffer);
+	double GetSampleRate() const { return sampleRate_; }
+	unsigned long GetFramesPerBuffer() const { return framesPerBuffer_; }
+
+	// Parse luma source into the song. Returns 0 on success.
+	int Parse(const char* fileName);
+	int Parse(const char* text, size_t size);
+	// Threads large inputs are parsed on, see ParseContext::SetNumThreads
+	void SetParseThreads(unsigned numThreads) { parser_.SetNumThreads(numThreads); }
+
+	// Flatten the song into the timeline and rewind playback
+	void Compile();
+
+	// Parse and compile a song file in one go. With useCache the compiled
+	// timeline is kept next to the source (see SONG_CACHE_EXTENSION), and as
+	// long as the source is unchanged later loads map it and skip parsing.
+	// A song loaded from the cache has a timeline but no patterns.
+	int Load(const char* fileName, bool useCache);
+
+	// Processing graph. Plugins are loaded by file name, or by name from the
+	// plugin search path, and a NULL name stands for the built-in synth.
+	// What the properties scan finds is kept in the plugin cache, so the
+	// next load of an unchanged plugin skips it. The cache file is read once
+	// by the first plugin loaded, and written by SavePluginCache or at
+	// cleanup. Each call adds a node
+	// feeding output, the master bus unless given, and returns it, or -1 if
+	// the plugin did not load. Build from the master bus inwards: add an
+	// effect or bus first, then what goes through it. Not while audio runs.
+	//
+	// An instrument plays the patterns on one MIDI channel, 0 to 15, or on
+	// all of them with -1.
+	int AddInstrument(const char* fileName, int channel = -1, int output = -1);
+	int AddEffect(const char* fileName, int output = -1);
+	int AddBus(int output = -1);
+	int GetMasterBus();
+	// Which output channel each of a plugin's outputs goes to, negative to
+	// leave it out. By default a plugin with more than two outputs has
+	// them alternate left and right, so a multi-out instrument is heard
+	// whole. Returns false if node is not a plugin.
+	bool SetOutputMap(int node, const vector<int>& map) { return graph_.SetChannelMap(node, map); }
+	// Threads that render graph branches alongside the audio thread
+	void SetGraphWorkers(unsigned numWorkers) { graph_.SetNumWorkers(numWorkers); }
+	// Frames to send events early by on top of the longest delay the
+	// instruments report, for ones that respond late without saying so.
+	// Not while audio runs.
+	void SetLookahead(unsigned long frames) { lookahead_ = frames; scheduleLookahead_ = pluginDelay_ + lookahead_; }
+	// Single instrument playing every channel
+	bool LoadPlugin(const char* fileName = DEFAULT_PLUGIN_PATH) { return AddInstrument(fileName) >= 0; }
+	bool LoadBuiltinSynth() { return AddInstrument(NULL) >= 0; }
+	PluginSearchPath& GetPluginPath() { return pluginPath_; }
+	// Cache file for plugin info, PluginInfoCache::GetDefaultFileName
+	// unless set. An empty name turns the cache off.
+	void SetPluginCache(const char* fileName) { pluginCacheFile_ = fileName; pluginCacheLoaded_ = false; }
+	// Write what the plugins loaded so far added to the plugin cache, once
+	// the graph is built
+	void SavePluginCache();
+	// Of the plugin at a node, NULL for a bus
+	const PluginInfo* GetPluginInfo(int node) const;
+
+	// Back to the start of the timeline. Only while audio is stopped, use
+	// Locate while it runs.
+	void Rewind();
+	bool IsFinished() const { return cursor_.IsFinished() && !looping_; }
+
+	// Transport. These can be called from any one control thread while the
+	// audio path runs; they are queued and take effect at the next block.
+	// Positions are in samples, bars are counted from 0. Locating releases
+	// the notes that are sounding and strikes the ones the song has sounding
+	// at the new position. Once playback reaches a loop's end it goes back
+	// to the loop's start.
+	bool Play() { return transport_.Push(TRANSPORT_PLAY); }
+	bool Stop() { return transport_.Push(TRANSPORT_STOP); }
+	bool Locate(long long position) { return transport_.Push(TRANSPORT_LOCATE, position); }
+	bool LocateBar(long long bar) { return transport_.Push(TRANSPORT_LOCATE_BAR, bar); }
+	bool SetLoop(long long start, long long end) { return transport_.Push(TRANSPORT_LOOP, start, end); }
+	bool SetLoopBars(long long firstBar, long long endBar) { return transport_.Push(TRANSPORT_LOOP_BARS, firstBar, endBar); }
+	bool ClearLoop() { return transport_.Push(TRANSPORT_LOOP_OFF); }
+
+	// Render the next block. The block's events reach the instruments before
+	// they render, so each note starts on the frame it was scheduled for.
+	void RenderBlock(float** outputs, unsigned long framesPerBuffer);
+
+	// Play through a backend until StopAudio, which the backend has to
+	// outlive. Without one the default PortAudio device is used.
+	bool StartAudio(AudioBackend& backend);
+	bool StartAudio() { return StartAudio(portAudio_); }
+	bool StopAudio();
+	void Cleanup();
+
+	// Reparse the song file on a background thread whenever it changes and
+	// hand the new timeline to the audio path, which picks it up at the
+	// next block without a restart. Playback carries on from the same
+	// position. Notes that are sounding keep sounding if the new song
+	// releases them later and are released at once if it does not.
+	bool StartWatching(const char* fileName, unsigned int pollMs = 100);
+	void StopWatching();
+
+	// Events sent to the plugin are logged through a ring and printed by a
+	// background thread, so the audio path never touches stdout.
+	void SetLogEvents(bool logEvents) { logEvents_ = logEvents; }
+	void StartLog() { logThread_.Start(&eventLog_); }
+	void StopLog() { logThread_.Stop(); }
+
+	// Timing of the audio path: how long blocks take against their
+	// deadline, which stage the time goes to, events per block and the
+	// backend's xruns. Counted from StartAudio, or from a rewind for
+	// offline renders. With a dump interval the counters are printed that
+	// often by a background thread while audio runs, 0 for never.
+	void GetTelemetry(TelemetrySnapshot& snapshot) const;
+	void SetTelemetryDump(unsigned int intervalMs) { telemetryDumpMs_ = intervalMs; }
+
+	Song& GetSong() { return song_; }
+	// Sample position of the last event, for a control thread before audio
+	// starts
+	long long GetLength() const;
+	// The first instrument, for its editor
+	AEffect* GetEffect() { return instances_.empty() ? NULL : instances_[0]->effect; }
+	float** GetOutputBuffers() { AllocateOutputBuffers(); return outputBuffers_; }
+
+private:
+	Session(const Session&);
+	Session& operator=(const Session&);
+
+	// A plugin or built-in synth in the graph
+	struct Instance
+	{
+		Instance() : loader(NULL), synth(NULL), effect(NULL), node(-1) {}
+		PluginLoader* loader;
+		SimdSynth* synth;
+		AEffect* effect;
+		PluginInfo info;
+		int node;
+	};
 
-	printf ("HOST> Close effect...\n");
-	effect->dispatcher (effect, effClose, 0, 0, 0, 0);
+	Instance* LoadInstance(const char* fileName);
+	PluginInfoCache* GetPluginCache();
+	bool InitEffect(Instance& instance, const PluginInfo* known);
+	void CloseInstance(Instance* instance);
+	int AddNode(Instance* instance, int output);
+	void AllocateOutputBuffers();
+	void ScheduleBlock(unsigned long framesPerBuffer);
+	void QueueEvents(long long end, long long lead, int blockOffset);
+	void ApplyTransport();
+	void Jump(long long position, int offset);
+	void SendNoteOn(int offset, int key, short velocity, long long position);
+	void SendNoteOff(int offset, int key, long long position);
+	void SwitchTimeline();
+	void WatchLoop(string fileName, unsigned int pollMs);
+	void DumpLoop(unsigned int intervalMs);
+	bool Reload(const char* fileName);
+
+	static void AudioCallback(float** channels, unsigned long frames, void* userData);
+
+	ParseContext parser_;
+	Song song_;
+
+	// compiled song and the playback position in it
+	Timeline timeline_;
+	TimelineCursor cursor_;
+	// The timeline being played: timeline_, or one built by a reload. The
+	// watcher publishes a new one through pendingTimeline_, the audio path
+	// takes it and hands back the one it replaced through retiredTimeline_
+	// for the watcher to delete, so the audio path never allocates, frees
+	// or waits.
+	Timeline* playing_;
+	atomic<Timeline*> pendingTimeline_;
+	atomic<Timeline*> retiredTimeline_;
+	// note keys (see GetNoteKey) the instruments have been sent a note on
+	// for and no note off yet
+	unsigned long long sounding_[MIDI_NUM_KEYS / 64];
+
+	// transport state, owned by the audio path
+	TransportQueue transport_;
+	bool running_;
+	bool looping_;
+	long long loopStart_;
+	long long loopEnd_;
+	// set after a rewind, the next block first moves the song
+	// scheduleLookahead_ frames ahead of what is rendered
+	bool needsLead_;
+	thread watchThread_;
+	atomic<bool> watching_;
+	SongCache cache_; // holds the mapped timeline when it came from the cache
+
+	ProcessGraph graph_;
+	vector<Instance*> instances_;
+	int masterBus_;
+	// instrument nodes playing each MIDI channel
+	vector<int> channelNodes_[MIDI_CHANNELS];
+	PluginSearchPath pluginPath_;
+	string pluginCacheFile_;
+	PluginInfoCache pluginCache_;
+	bool pluginCacheLoaded_;
+	float** outputBuffers_;
+
+	double sampleRate_;
+	unsigned long framesPerBuffer_;
+	PortAudioBackend portAudio_;
+	AudioBackend* backend_; // while audio runs
+
+	// Frames the song runs ahead of what is being rendered. Events are sent
+	// this much earlier than the frame they sound on, which keeps them in time
+	// with plugins that report a processing delay. The longest delay of any
+	// instrument, the others are not delayed to match, plus lookahead_.
+	unsigned long scheduleLookahead_;
+	unsigned long pluginDelay_;
+	unsigned long lookahead_; // see SetLookahead
+	// Frames rendered since playback started
+	long long renderPosition_;
+
+	bool logEvents_;
+	LogRing eventLog_;
+	LogThread logThread_;
+
+	Telemetry telemetry_;
+	// note events sent in the block being rendered
+	unsigned long blockEvents_;
+	unsigned int telemetryDumpMs_;
+	// the last backend's, once audio has stopped
+	unsigned long long numUnderflows_;
+	unsigned long long numOverflows_;
+	thread dumpThread_;
+	atomic<bool> dumping_;
+};
 
-	delete vstEvents;
-	delete pluginLoader;
+Session::Session()
+: playing_(&timeline_), pendingTimeline_(NULL), retiredTimeline_(NULL),
+  running_(true), looping_(false), loopStart_(0), loopEnd_(0), needsLead_(true), watching_(false),
+  masterBus_(-1), pluginCacheFile_(PluginInfoCache::GetDefaultFileName()), pluginCacheLoaded_(false), outputBuffers_(NULL),
+  sampleRate_(AUDIO_SAMPLE_RATE), framesPerBuffer_(AUDIO_FRAMES_PER_BUFFER), backend_(NULL),
+  scheduleLookahead_(0), pluginDelay_(0), lookahead_(0), renderPosition_(0), logEvents_(true), blockEvents_(0), telemetryDumpMs_(0), numUnderflows_(0), numOverflows_(0), dumping_(false)
+{
+	memset(sounding_, 0, sizeof(sounding_));
+	graph_.SetBlockSize(framesPerBuffer_);
+	graph_.SetTelemetry(&telemetry_);
+	telemetry_.SetSampleRate(sampleRate_);
 }
 
-bool LoadPlugin()
+Session::~Session()
 {
-	const char* fileName = "C:\\Program Files\\VSTPlugins\\Circle.dll";
+	Cleanup();
+	Timeline* timelines[] = { playing_, pendingTimeline_.load(), retiredTimeline_.load() };
+	for (int i=0; i<3; i++) {
+		if (timelines[i] != &timeline_) {
+			delete timelines[i];
+		}
+	}
+	if (outputBuffers_) {
+		for (int i=0; i<AUDIO_OUTPUT_CHANNELS; i++) {
+			delete[] outputBuffers_[i];
+		}
+		delete[] outputBuffers_;
+	}
+}
+
+void Session::SetAudioFormat(double sampleRate, unsigned long framesPerBuffer)
+{
+	sampleRate_ = sampleRate;
+	telemetry_.SetSampleRate(sampleRate_);
+	if (framesPerBuffer != framesPerBuffer_ && outputBuffers_) {
+		for (int i=0; i<AUDIO_OUTPUT_CHANNELS; i++) {
+			delete[] outputBuffers_[i];
+		}
+		delete[] outputBuffers_;
+		outputBuffers_ = NULL;
+	}
+	framesPerBuffer_ = framesPerBuffer;
+	graph_.SetBlockSize(framesPerBuffer_);
+}
+
+int Session::Parse(const char* fileName)
+{
+	return parser_.ParseFile(fileName, &song_);
+}
+
+int Session::Parse(const char* text, size_t size)
+{
+	return parser_.ParseText(text, size, &song_);
+}
 
-	pluginLoader = new PluginLoader();
+void Session::Compile()
+{
+	song_.Compile(sampleRate_, timeline_);
+	cache_.Close();
+	playing_ = &timeline_;
+	cursor_.SetTimeline(&timeline_);
+	Rewind();
+}
+
+int Session::Load(const char* fileName, bool useCache)
+{
+	SourceBuffer source;
+	if (!source.Open(fileName)) {
+		fprintf(stderr, "Could not open %s\n", fileName);
+		return -1;
+	}
+	string cacheName = string(fileName) + SONG_CACHE_EXTENSION;
+	unsigned long long sourceHash = SongCache::HashSource(source.GetData(), source.GetSize());
+	// tempo lines in the source are covered by the hash, this is the tempo it starts from
+	float bpm = song_.GetTempo();
+
+	if (useCache && cache_.Load(cacheName.c_str(), sourceHash, sampleRate_, bpm, timeline_)) {
+		playing_ = &timeline_;
+		cursor_.SetTimeline(&timeline_);
+		Rewind();
+		return 0;
+	}
+
+	int ret = parser_.ParseText(source.GetData(), source.GetSize(), &song_);
+	if (ret != 0) {
+		return ret;
+	}
+	Compile();
+
+	if (useCache && !SongCache::Save(cacheName.c_str(), sourceHash, sampleRate_, bpm, timeline_)) {
+		printf("HOST> Could not write song cache %s\n", cacheName.c_str());
+	}
+	return 0;
+}
+
+void Session::Rewind()
+{
+	cursor_.Reset();
+	renderPosition_ = 0;
+	needsLead_ = true;
+	telemetry_.Reset();
+}
+
+bool Session::StartWatching(const char* fileName, unsigned int pollMs)
+{
+	if (watching_) {
+		return false;
+	}
+	watching_ = true;
+	watchThread_ = thread(&Session::WatchLoop, this, string(fileName), pollMs);
+	return true;
+}
+
+void Session::StopWatching()
+{
+	if (!watching_) {
+		return;
+	}
+	watching_ = false;
+	watchThread_.join();
+}
+
+// Modification times to the nanosecond where the platform keeps them
+static bool SameModifyTime(const struct stat& a, const struct stat& b)
+{
+#if defined(__APPLE__)
+	return a.st_mtimespec.tv_sec == b.st_mtimespec.tv_sec && a.st_mtimespec.tv_nsec == b.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return a.st_mtime == b.st_mtime;
+#else
+	return a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+#endif
+}
+
+// Seconds apart two modification times must be for the coarsest file
+// systems to tell them apart (FAT keeps two)
+static const time_t MODIFY_TIME_GRANULARITY = 2;
+
+// What the file holds now, 0 if it can not be read. The watched file is
+// read rather than mapped, an editor may truncate it while it is hashed.
+static unsigned long long HashFile(const char* fileName)
+{
+	SourceBuffer source;
+	if (!source.Read(fileName)) {
+		return 0;
+	}
+	return SongCache::HashSource(source.GetData(), source.GetSize());
+}
+
+void Session::WatchLoop(string fileName, unsigned int pollMs)
+{
+	struct stat lastStat;
+	bool exists = stat(fileName.c_str(), &lastStat) == 0;
+	time_t hashTime = time(NULL);
+	unsigned long long lastHash = exists ? HashFile(fileName.c_str()) : 0;
+	while (watching_) {
+		this_thread::sleep_for(chrono::milliseconds(pollMs));
+
+		// the audio path has let go of the timeline it replaced
+		Timeline* retired = retiredTimeline_.exchange(NULL);
+		if (retired != &timeline_) {
+			delete retired;
+		}
+
+		struct stat st;
+		if (stat(fileName.c_str(), &st) != 0) {
+			exists = false;
+			continue;
+		}
+		unsigned long long hash;
+		if (exists && SameModifyTime(st, lastStat) && st.st_size == lastStat.st_size) {
+			// a save of the same size only keeps the modification time if it
+			// lands within the file system's time granularity of it, so the
+			// contents are compared until the last look is past that
+			if (hashTime >= st.st_mtime + MODIFY_TIME_GRANULARITY) {
+				continue;
+			}
+			hashTime = time(NULL);
+			hash = HashFile(fileName.c_str());
+			if (hash == lastHash) {
+				continue;
+			}
+		}
+		else {
+			hashTime = time(NULL);
+			hash = HashFile(fileName.c_str());
+		}
+		exists = true;
+		lastStat = st;
+		lastHash = hash;
+		Reload(fileName.c_str());
+	}
+}
+
+// Build a timeline from the file as it is now and publish it to the audio
+// path. Runs on the watch thread, so it has a parser and song of its own,
+// set up like the session's. The file is read, not mapped, as in HashFile.
+bool Session::Reload(const char* fileName)
+{
+	SourceBuffer source;
+	if (!source.Read(fileName)) {
+		printf("HOST> Could not read %s, still playing the previous version\n", fileName);
+		return false;
+	}
+	ParseContext parser;
+	parser.SetNumThreads(parser_.numThreads);
+	parser.SetParallelMinSize(parser_.parallelMinSize);
+	Song song;
+	if (parser.ParseText(source.GetData(), source.GetSize(), &song) != 0) {
+		printf("HOST> %s has errors, still playing the previous version\n", fileName);
+		return false;
+	}
+	Timeline* timeline = new Timeline();
+	song.Compile(sampleRate_, *timeline);
+
+	// a timeline the audio path has not taken yet is simply replaced
+	Timeline* unused = pendingTimeline_.exchange(timeline);
+	delete unused;
+	printf("HOST> Reloaded %s\n", fileName);
+	return true;
+}
+
+// Play a newly published timeline from the current position. Called at the
+// start of a block on the audio path.
+void Session::SwitchTimeline()
+{
+	// wait for the watcher to collect the last retired timeline first
+	if (pendingTimeline_.load() == NULL || retiredTimeline_.load() != NULL) {
+		return;
+	}
+	Timeline* next = pendingTimeline_.exchange(NULL);
+	if (next == NULL) {
+		return;
+	}
+	cursor_.Switch(next);
+
+	// release what the new song does not expect to be sounding here
+	unsigned char expected[MIDI_NUM_KEYS];
+	next->GetSounding(cursor_.GetIndex(), expected);
+	for (int key=0; key<MIDI_NUM_KEYS; key++) {
+		if ((sounding_[key >> 6] >> (key & 63)) & 1 && expected[key] == 0) {
+			SendNoteOff(0, key, cursor_.GetPosition());
+		}
+	}
+
+	retiredTimeline_.store(playing_);
+	playing_ = next;
+}
+
+// Apply the transport commands queued since the last block
+void Session::ApplyTransport()
+{
+	TransportCommand c;
+	while (transport_.Pop(c)) {
+		switch (c.type)
+		{
+		case TRANSPORT_PLAY:
+			running_ = true;
+			break;
+		case TRANSPORT_STOP:
+			// stays put, and releases everything since nothing sounds while stopped
+			running_ = false;
+			Jump(cursor_.GetPosition(), 0);
+			break;
+		case TRANSPORT_LOCATE:
+			Jump(c.a > 0 ? c.a : 0, 0);
+			needsLead_ = true;
+			break;
+		case TRANSPORT_LOCATE_BAR:
+			Jump(playing_->GetBarPosition(c.a > 0 ? (size_t)c.a : 0), 0);
+			needsLead_ = true;
+			break;
+		case TRANSPORT_LOOP:
+			loopStart_ = c.a;
+			loopEnd_ = c.b;
+			looping_ = loopEnd_ > loopStart_;
+			break;
+		case TRANSPORT_LOOP_BARS:
+			loopStart_ = playing_->GetBarPosition(c.a > 0 ? (size_t)c.a : 0);
+			loopEnd_ = playing_->GetBarPosition(c.b > 0 ? (size_t)c.b : 0);
+			looping_ = loopEnd_ > loopStart_;
+			break;
+		case TRANSPORT_LOOP_OFF:
+			looping_ = false;
+			break;
+		}
+	}
+}
+
+// Move playback to position. Notes sounding now are released and the ones
+// the song has sounding at position are struck again, all at offset
+// frames into the block.
+void Session::Jump(long long position, int offset)
+{
+	long long from = cursor_.GetPosition();
+	for (int key=0; key<MIDI_NUM_KEYS; key++) {
+		if ((sounding_[key >> 6] >> (key & 63)) & 1) {
+			SendNoteOff(offset, key, from);
+		}
+	}
+
+	cursor_.Locate(position);
+	if (!running_) {
+		return;
+	}
+	unsigned char chase[MIDI_NUM_KEYS];
+	playing_->GetSounding(cursor_.GetIndex(), chase);
+	for (int key=0; key<MIDI_NUM_KEYS; key++) {
+		if (chase[key] != 0) {
+			SendNoteOn(offset, key, chase[key], position);
+		}
+	}
+}
+
+// Send a note to the instruments playing its channel
+void Session::SendNoteOn(int offset, int key, short velocity, long long position)
+{
+	int channel = key >> 7;
+	short pitch = (short)(key & 127);
+	const vector<int>& nodes = channelNodes_[channel];
+	for (size_t i=0; i<nodes.size(); i++) {
+		PlayNoteOn(graph_.GetEvents(nodes[i]), offset, pitch, velocity, 0, channel);
+	}
+	sounding_[key >> 6] |= 1ULL << (key & 63);
+	blockEvents_++;
+	if (logEvents_) {
+		LogRecord r;
+		r.type = LOG_NOTE_ON;
+		r.position = position;
+		r.offset = offset;
+		r.pitch = pitch;
+		r.velocity = velocity;
+		r.channel = (short)channel;
+		eventLog_.Push(r);
+	}
+}
+
+void Session::SendNoteOff(int offset, int key, long long position)
+{
+	int channel = key >> 7;
+	short pitch = (short)(key & 127);
+	const vector<int>& nodes = channelNodes_[channel];
+	for (size_t i=0; i<nodes.size(); i++) {
+		PlayNoteOff(graph_.GetEvents(nodes[i]), offset, pitch, channel);
+	}
+	sounding_[key >> 6] &= ~(1ULL << (key & 63));
+	blockEvents_++;
+	if (logEvents_) {
+		LogRecord r;
+		r.type = LOG_NOTE_OFF;
+		r.position = position;
+		r.offset = offset;
+		r.pitch = pitch;
+		r.velocity = 0;
+		r.channel = (short)channel;
+		eventLog_.Push(r);
+	}
+}
+
+// Queue the events from the cursor up to song position end. The first
+// lead frames of that are still catching up with the lookahead and go out
+// at blockOffset; the rest land blockOffset frames into the block plus
+// their distance past the lead.
+void Session::QueueEvents(long long end, long long lead, int blockOffset)
+{
+	long long start = cursor_.GetPosition();
+	size_t first, last;
+	cursor_.Advance((unsigned long)(end - start), first, last);
+	const Timeline& timeline = *playing_;
+	for (size_t j=first; j<last; j++) {
+		long long position = timeline.GetPosition(j);
+		long long offset = position - start - lead;
+		int offsetInSamples = blockOffset + (offset > 0 ? (int)offset : 0);
+		unsigned char status = timeline.GetStatus(j);
+		int key = GetNoteKey(status, timeline.GetPitch(j));
+		if (IsNoteOff(status)) {
+			SendNoteOff(offsetInSamples, key, position);
+		}
+		else {
+			SendNoteOn(offsetInSamples, key, timeline.GetVelocity(j), position);
+		}
+	}
+}
+
+// Queue the events that sound in the next block of frames. The song runs
+// scheduleLookahead_ frames ahead of the block; the lead is taken up in
+// the first block after a rewind or locate, whose events before it go out
+// at the start of the block. A loop end inside the block splits it.
+void Session::ScheduleBlock(unsigned long framesPerBuffer)
+{
+	long long lead = needsLead_ ? scheduleLookahead_ : 0;
+	needsLead_ = false;
+	long long done = 0;
+	while (done < (long long)framesPerBuffer) {
+		long long start = cursor_.GetPosition();
+		if (looping_ && start == loopEnd_) {
+			Jump(loopStart_, (int)done);
+			continue;
+		}
+		long long end = start + lead + (framesPerBuffer - done);
+		if (looping_ && start < loopEnd_ && end > loopEnd_) {
+			end = loopEnd_;
+		}
+		QueueEvents(end, lead, (int)done);
+
+		long long length = end - start;
+		done += length > lead ? length - lead : 0;
+		lead = lead > length ? lead - length : 0;
+	}
+}
+
+void Session::RenderBlock(float** outputs, unsigned long framesPerBuffer)
+{
+	Telemetry::Clock::time_point start = Telemetry::Now();
+	blockEvents_ = 0;
+	ApplyTransport();
+	SwitchTimeline();
+	if (running_) {
+		ScheduleBlock(framesPerBuffer);
+	}
+	Telemetry::Clock::time_point scheduled = Telemetry::Now();
+	graph_.Process(outputs, framesPerBuffer);
+	renderPosition_ += framesPerBuffer;
+	telemetry_.AddStage(STAGE_SCHEDULE, Telemetry::Elapsed(start, scheduled));
+	telemetry_.AddBlock(framesPerBuffer, Telemetry::Elapsed(start, Telemetry::Now()), blockEvents_);
+}
+
+/* Called by the audio backend when audio is needed, maybe at interrupt
+** level, so don't do anything that could mess up the system like calling
+** malloc() or free(). Nothing on this path allocates, locks or does I/O:
+** the timeline and the event batch are preallocated and logging goes
+** through eventLog_. userData is the session being played.
+*/
+void Session::AudioCallback(float** channels, unsigned long frames, void* userData)
+{
+	Session* session = (Session*)userData;
+	session->RenderBlock(channels, frames);
+}
+
+// init buffer used to retrieve data from plugin
+void Session::AllocateOutputBuffers()
+{
+	if (outputBuffers_) {
+		return;
+	}
+	outputBuffers_ = new float*[AUDIO_OUTPUT_CHANNELS];
+	for (int i=0; i<AUDIO_OUTPUT_CHANNELS; i++) {
+		outputBuffers_[i] = new float[framesPerBuffer_];
+	}
+}
+
+bool Session::StartAudio(AudioBackend& backend)
+{
+	AudioConfig config;
+	config.sampleRate = sampleRate_;
+	config.framesPerBuffer = framesPerBuffer_;
+	config.numChannels = AUDIO_OUTPUT_CHANNELS;
+
+	StartLog();
+	telemetry_.Reset();
+
+	if (!backend.Start(config, AudioCallback, this)) {
+		StopLog();
+		return false;
+	}
+	backend_ = &backend;
+	if (telemetryDumpMs_ > 0) {
+		dumping_ = true;
+		dumpThread_ = thread(&Session::DumpLoop, this, telemetryDumpMs_);
+	}
+	return true;
+}
+
+bool Session::StopAudio()
+{
+	if (!backend_) {
+		return true;
+	}
+	if (dumping_) {
+		dumping_ = false;
+		dumpThread_.join();
+	}
+	bool ok = backend_->Stop();
+	// kept for GetTelemetry once the backend is gone
+	numUnderflows_ = backend_->GetNumUnderflows();
+	numOverflows_ = backend_->GetNumOverflows();
+	backend_ = NULL;
+
+	StopLog();
+
+	return ok;
+}
+
+void Session::GetTelemetry(TelemetrySnapshot& snapshot) const
+{
+	telemetry_.Snapshot(snapshot);
+	if (backend_) {
+		snapshot.numUnderflows = backend_->GetNumUnderflows();
+		snapshot.numOverflows = backend_->GetNumOverflows();
+	}
+	else {
+		snapshot.numUnderflows = numUnderflows_;
+		snapshot.numOverflows = numOverflows_;
+	}
+}
+
+// Print the telemetry every intervalMs while audio runs
+void Session::DumpLoop(unsigned int intervalMs)
+{
+	chrono::steady_clock::time_point next = chrono::steady_clock::now();
+	while (dumping_) {
+		next += chrono::milliseconds(intervalMs);
+		// wake up often enough for StopAudio not to wait long
+		while (dumping_ && chrono::steady_clock::now() < next) {
+			this_thread::sleep_for(chrono::milliseconds(10));
+		}
+		if (!dumping_) {
+			break;
+		}
+		TelemetrySnapshot snapshot;
+		GetTelemetry(snapshot);
+		PrintTelemetry(snapshot, sampleRate_);
+	}
+}
+
+long long Session::GetLength() const
+{
+	size_t numEvents = playing_->GetNumEvents();
+	return numEvents > 0 ? playing_->GetPosition(numEvents - 1) : 0;
+}
+
+void Session::Cleanup()
+{
+	StopWatching();
+
+	StopAudio();
+
+	// for plugins loaded outside a GraphLayout
+	SavePluginCache();
+
+	unsigned long numDropped = 0;
+	for (int i=0; i<graph_.GetNumNodes(); i++) {
+		numDropped += graph_.GetEvents(i).numDropped;
+	}
+	for (size_t i=0; i<instances_.size(); i++) {
+		if (instances_[i]->synth) {
+			numDropped += instances_[i]->synth->GetNumDropped();
+		}
+	}
+	if (numDropped > 0) {
+		printf ("HOST> %lu MIDI events did not fit in a block and were dropped\n", numDropped);
+	}
+
+	for (size_t i=0; i<instances_.size(); i++) {
+		CloseInstance(instances_[i]);
+	}
+	instances_.clear();
+	graph_.Clear();
+	masterBus_ = -1;
+	for (int c=0; c<MIDI_CHANNELS; c++) {
+		channelNodes_[c].clear();
+	}
+	pluginDelay_ = 0;
+	scheduleLookahead_ = lookahead_;
+}
+
+void Session::CloseInstance(Instance* instance)
+{
+	if (instance->effect) {
+		printf ("HOST> Suspend effect...\n");
+		instance->effect->dispatcher (instance->effect, effMainsChanged, 0, 0, 0, 0);
+
+		printf ("HOST> Close effect...\n");
+		instance->effect->dispatcher (instance->effect, effClose, 0, 0, 0, 0);
+	}
+	delete instance->synth;
+	delete instance->loader;
+	delete instance;
+}
+
+// The bus everything ends up in, the graph's output
+int Session::GetMasterBus()
+{
+	if (masterBus_ < 0) {
+		masterBus_ = graph_.AddNode(NULL);
+		graph_.SetOutput(masterBus_);
+	}
+	return masterBus_;
+}
+
+int Session::AddInstrument(const char* fileName, int channel, int output)
+{
+	if (channel < -1 || channel >= MIDI_CHANNELS) {
+		printf ("MIDI channel %d is out of range\n", channel + 1);
+		return -1;
+	}
+	Instance* instance = LoadInstance(fileName);
+	if (!instance) {
+		return -1;
+	}
+	int node = AddNode(instance, output);
+	for (int c=0; c<MIDI_CHANNELS; c++) {
+		if (channel < 0 || channel == c) {
+			channelNodes_[c].push_back(node);
+		}
+	}
+	// send events early by however long the slowest instrument takes to respond
+	if ((unsigned long)instance->effect->initialDelay > pluginDelay_) {
+		pluginDelay_ = instance->effect->initialDelay;
+		scheduleLookahead_ = pluginDelay_ + lookahead_;
+	}
+	return node;
+}
+
+int Session::AddEffect(const char* fileName, int output)
+{
+	Instance* instance = LoadInstance(fileName);
+	if (!instance) {
+		return -1;
+	}
+	return AddNode(instance, output);
+}
+
+int Session::AddBus(int output)
+{
+	int node = graph_.AddNode(NULL);
+	graph_.Connect(node, output < 0 ? GetMasterBus() : output);
+	return node;
+}
+
+int Session::AddNode(Instance* instance, int output)
+{
+	instance->node = graph_.AddNode(instance->effect);
+	graph_.Connect(instance->node, output < 0 ? GetMasterBus() : output);
+	instances_.push_back(instance);
+	return instance->node;
+}
+
+const PluginInfo* Session::GetPluginInfo(int node) const
+{
+	for (size_t i=0; i<instances_.size(); i++) {
+		if (instances_[i]->node == node) {
+			return &instances_[i]->info;
+		}
+	}
+	return NULL;
+}
+
+// Load a plugin, or the built-in synth if fileName is NULL, and run its
+// init sequence. Returns NULL if that fails.
+Session::Instance* Session::LoadInstance(const char* fileName)
+{
+	Instance* instance = new Instance();
+	if (!fileName)
+	{
+		printf ("HOST> Using built-in synth...\n");
+		instance->synth = new SimdSynth();
+		instance->effect = instance->synth->GetEffect();
+		if (!InitEffect (*instance, NULL))
+		{
+			CloseInstance (instance);
+			return NULL;
+		}
+		return instance;
+	}
+
+	string path;
+	if (!pluginPath_.Find (fileName, path))
+	{
+		printf ("VST Plugin %s not found!\n", fileName);
+		CloseInstance (instance);
+		return NULL;
+	}
+
+	instance->loader = new PluginLoader();
 
 	printf ("HOST> Load library...\n");
-	if (!pluginLoader->loadLibrary (fileName))
+	if (!instance->loader->loadLibrary (path.c_str ()))
 	{
 		printf ("Failed to load VST Plugin library!\n");
-		return false;
+		CloseInstance (instance);
+		return NULL;
 	}
 
-	PluginEntryProc mainEntry = pluginLoader->getMainEntry();
+	PluginEntryProc mainEntry = instance->loader->getMainEntry();
 	if (!mainEntry)
 	{
 		printf ("VST Plugin main entry not found!\n");
-		return false;
+		CloseInstance (instance);
+		return NULL;
 	}
 
 	printf ("HOST> Create effect...\n");
-	effect = mainEntry (HostCallback);
-	if (!effect)
+	instance->effect = mainEntry (HostCallback);
+	if (!instance->effect)
 	{
 		printf ("Failed to create effect instance!\n");
-		return false;
+		CloseInstance (instance);
+		return NULL;
+	}
+
+	// the plugin has to be instantiated to be played anyway, the cache
+	// only spares the properties walk
+	PluginInfoCache* cache = GetPluginCache ();
+	const PluginInfo* known = cache ? cache->Find (path) : NULL;
+	instance->info.path = path;
+	if (!InitEffect (*instance, known))
+	{
+		CloseInstance (instance);
+		return NULL;
 	}
+	if (cache && !known)
+		cache->Store (instance->info);
+	return instance;
+}
 
+// The plugin cache, read from its file the first time, or NULL if it is
+// turned off
+PluginInfoCache* Session::GetPluginCache()
+{
+	if (pluginCacheFile_.empty()) {
+		return NULL;
+	}
+	if (!pluginCacheLoaded_) {
+		pluginCache_.Load(pluginCacheFile_.c_str());
+		pluginCacheLoaded_ = true;
+	}
+	return &pluginCache_;
+}
+
+void Session::SavePluginCache()
+{
+	if (pluginCacheLoaded_ && pluginCache_.IsDirty() && !pluginCache_.Save(pluginCacheFile_.c_str())) {
+		printf("HOST> Could not write plugin cache %s: %s\n", pluginCacheFile_.c_str(), strerror(errno));
+	}
+}
+
+// Run the init sequence on a plugin instance. Its properties are scanned
+// into instance.info unless they are already known.
+bool Session::InitEffect(Instance& instance, const PluginInfo* known)
+{
+	AEffect* effect = instance.effect;
 	if (effect->numOutputs > VST_MAX_OUTPUT_CHANNELS_SUPPORTED) {
-		printf("Plugin has more outputs than are supported by this host. Max outputs support is: %d\n", effect->numOutputs);
-		Cleanup();
+		printf("Plugin has more outputs than are supported by this host. Max outputs support is: %d\n", VST_MAX_OUTPUT_CHANNELS_SUPPORTED);
 		return false;
 	}
 
-	int nHdrLen = sizeof(VstEvents) + (100 * sizeof(VstMidiEvent *));
-	BYTE * effEvData = new BYTE[nHdrLen];
-	vstEvents = (VstEvents *) effEvData;
-	vstEvents->numEvents = 0;
-	
 	printf ("HOST> Init sequence...\n");
 	effect->dispatcher (effect, effOpen, 0, 0, 0, 0);
-	effect->dispatcher (effect, effSetSampleRate, 0, 0, 0, (float)AUDIO_SAMPLE_RATE);
-	effect->dispatcher (effect, effSetBlockSize, 0, AUDIO_FRAMES_PER_BUFFER, 0, 0);
+	effect->dispatcher (effect, effSetSampleRate, 0, 0, 0, (float)sampleRate_);
+	effect->dispatcher (effect, effSetBlockSize, 0, framesPerBuffer_, 0, 0);
 
 	printf ("HOST> Resume effect...\n");
 	effect->dispatcher (effect, effMainsChanged, 0, 1, 0, 0);
 
-	checkEffectProperties (effect);
+	if (known) {
+		printf ("HOST> Properties from the plugin cache...\n");
+		instance.info = *known;
+	}
+	else {
+		gatherEffectProperties (effect, instance.info);
+	}
+	printEffectProperties (instance.info);
 
 	//checkEffectEditor (effect);
 
-	//Cleanup();
-
 	return true;
 }
 
+//-------------------------------------------------------------------------------------------------------
+// GraphLayout
+//-------------------------------------------------------------------------------------------------------
+// The processing graph as the command line players describe it. Channels
+// are numbered from 1 as in the song, or * for all of them, and "synth"
+// names the built-in synth.
+//   -instrument <ch>=<plugin>  an instrument playing a channel
+//   -insert <ch>=<effect>      an effect after the instruments on a channel
+//   -master <effect>           an effect on the master bus
+//   -outmap <ch>=<list>        where the outputs of the instruments on a
+//                              channel go: 1 or 2 for left or right, - to
+//                              leave one out, e.g. 1,2,1,2,-,-
+// Effects run in the order they are given.
+struct GraphLayout
+{
+	vector<string> instruments;
+	vector<string> inserts;
+	vector<string> masters;
+	vector<string> outputMaps;
+
+	// Take one of the options above, false if it is not one
+	bool Parse(const char* option, const char* value)
+	{
+		if (strcmp(option, "-instrument") == 0) {
+			instruments.push_back(value);
+		}
+		else if (strcmp(option, "-insert") == 0) {
+			inserts.push_back(value);
+		}
+		else if (strcmp(option, "-master") == 0) {
+			masters.push_back(value);
+		}
+		else if (strcmp(option, "-outmap") == 0) {
+			outputMaps.push_back(value);
+		}
+		else {
+			return false;
+		}
+		return true;
+	}
+
+	// Load it all into the session, the graph built from the master bus in.
+	// The inserts of a channel make one chain that every instrument on the
+	// channel feeds, the first effect summing them.
+	bool Build(Session& session) const
+	{
+		int output = -1;
+		for (size_t i=masters.size(); i-- > 0; ) {
+			if ((output = session.AddEffect(PluginName(masters[i]), output)) < 0) {
+				return false;
+			}
+		}
+		map<int, int> chains; // channel to the first effect of its inserts
+		for (size_t i=0; i<instruments.size(); i++) {
+			string spec, plugin;
+			int channel;
+			if (!Split(instruments[i], spec, plugin) || !ParseChannel(spec, channel)) {
+				return false;
+			}
+			map<int, int>::iterator chain = chains.find(channel);
+			if (chain == chains.end()) {
+				int node = output;
+				for (size_t j=inserts.size(); j-- > 0; ) {
+					string insertSpec, effect;
+					int insertChannel;
+					if (!Split(inserts[j], insertSpec, effect) || !ParseChannel(insertSpec, insertChannel)) {
+						return false;
+					}
+					if (insertChannel == channel && (node = session.AddEffect(PluginName(effect), node)) < 0) {
+						return false;
+					}
+				}
+				chain = chains.insert(make_pair(channel, node)).first;
+			}
+			int node = session.AddInstrument(PluginName(plugin), channel, chain->second);
+			if (node < 0) {
+				return false;
+			}
+			for (size_t j=0; j<outputMaps.size(); j++) {
+				string mapSpec, list;
+				int mapChannel;
+				if (!Split(outputMaps[j], mapSpec, list) || !ParseChannel(mapSpec, mapChannel)) {
+					return false;
+				}
+				if (mapChannel == channel && !session.SetOutputMap(node, ParseMap(list))) {
+					return false;
+				}
+			}
+		}
+		session.SavePluginCache();
+		return true;
+	}
+
+private:
+	// "1" to "16" to 0 to 15, "*" to -1 for every channel
+	static bool ParseChannel(const string& spec, int& channel)
+	{
+		if (spec == "*") {
+			channel = -1;
+			return true;
+		}
+		char* end;
+		long number = strtol(spec.c_str(), &end, 10);
+		if (*end != '\0' || number < 1 || number > MIDI_CHANNELS) {
+			fprintf(stderr, "MIDI channels are 1 to 16 or *: %s\n", spec.c_str());
+			return false;
+		}
+		channel = (int)number - 1;
+		return true;
+	}
+
+	static bool Split(const string& spec, string& channel, string& plugin)
+	{
+		size_t equals = spec.find('=');
+		if (equals == string::npos || equals == 0 || equals + 1 == spec.size()) {
+			fprintf(stderr, "Expected <channel>=<plugin>: %s\n", spec.c_str());
+			return false;
+		}
+		channel = spec.substr(0, equals);
+		plugin = spec.substr(equals + 1);
+		return true;
+	}
+
+	// "1,2,-" to { 0, 1, -1 }
+	static vector<int> ParseMap(const string& list)
+	{
+		vector<int> map;
+		size_t start = 0;
+		while (start <= list.size()) {
+			size_t comma = list.find(',', start);
+			if (comma == string::npos) {
+				comma = list.size();
+			}
+			int channel = atoi(list.substr(start, comma - start).c_str());
+			map.push_back(channel > 0 ? channel - 1 : -1);
+			start = comma + 1;
+		}
+		return map;
+	}
+
+	static const char* PluginName(const string& name)
+	{
+		return name == "synth" ? NULL : name.c_str();
+	}
+};
+
 //-------------------------------------------------------------------------------------------------------
 /*int main (int argc, char* argv[])
 {
@@ -396,9 +1370,6 @@ bool LoadPlugin()
 		return -1;
 	}
 
-	songEvents.reserve(200);
-	songOffsets.reserve(200);
-
 	// parse input file
 	init_table();
 	is.open("C:\\Documents and Settings\\George\\My Documents\\luma2\\input.txt", ifstream::in);
@@ -434,7 +1405,17 @@ bool LoadPlugin()
 }*/
 
 //-------------------------------------------------------------------------------------------------------
-void checkEffectProperties (AEffect* effect)
+// plugin strings go into the tab separated plugin cache
+static string cleanString (const char* s)
+{
+	string result (s);
+	for (size_t i = 0; i < result.size (); i++)
+		if (result[i] == '\t' || result[i] == '\n' || result[i] == '\r')
+			result[i] = ' ';
+	return result;
+}
+
+void gatherEffectProperties (AEffect* effect, PluginInfo& info)
 {
 	printf ("HOST> Gathering properties...\n");
 
@@ -446,26 +1427,39 @@ void checkEffectProperties (AEffect* effect)
 	effect->dispatcher (effect, effGetVendorString, 0, 0, vendorString, 0);
 	effect->dispatcher (effect, effGetProductString, 0, 0, productString, 0);
 
-	printf ("Name = %s\nVendor = %s\nProduct = %s\n\n", effectName, vendorString, productString);
-
-	printf ("numPrograms = %d\nnumParams = %d\nnumInputs = %d\nnumOutputs = %d\n\n", 
-			effect->numPrograms, effect->numParams, effect->numInputs, effect->numOutputs);
-
-	// Iterate programs...
+	info.name = cleanString (effectName);
+	info.vendor = cleanString (vendorString);
+	info.product = cleanString (productString);
+	info.uniqueID = effect->uniqueID;
+	info.version = effect->version;
+	info.flags = effect->flags;
+	info.numInputs = effect->numInputs;
+	info.numOutputs = effect->numOutputs;
+	info.initialDelay = effect->initialDelay;
+
+	// Iterate programs, switching to the ones the plugin will not name
+	// otherwise and back to where it was afterwards
+	info.programs.clear ();
+	VstIntPtr currentProgram = effect->dispatcher (effect, effGetProgram, 0, 0, 0, 0);
+	bool programChanged = false;
 	for (VstInt32 progIndex = 0; progIndex < effect->numPrograms; progIndex++)
 	{
 		char progName[256] = {0};
 		if (!effect->dispatcher (effect, effGetProgramNameIndexed, progIndex, 0, progName, 0))
 		{
-			effect->dispatcher (effect, effSetProgram, 0, progIndex, 0, 0); // Note: old program not restored here!
+			effect->dispatcher (effect, effSetProgram, 0, progIndex, 0, 0);
 			effect->dispatcher (effect, effGetProgramName, 0, 0, progName, 0);
+			programChanged = true;
 		}
-		printf ("Program %03d: %s\n", progIndex, progName);
+		info.programs.push_back (cleanString (progName));
+	}
+	if (programChanged)
+	{
+		effect->dispatcher (effect, effSetProgram, 0, currentProgram, 0, 0);
 	}
-
-	printf ("\n");
 
 	// Iterate parameters...
+	info.params.clear ();
 	for (VstInt32 paramIndex = 0; paramIndex < effect->numParams; paramIndex++)
 	{
 		char paramName[256] = {0};
@@ -475,13 +1469,15 @@ void checkEffectProperties (AEffect* effect)
 		effect->dispatcher (effect, effGetParamName, paramIndex, 0, paramName, 0);
 		effect->dispatcher (effect, effGetParamLabel, paramIndex, 0, paramLabel, 0);
 		effect->dispatcher (effect, effGetParamDisplay, paramIndex, 0, paramDisplay, 0);
-		float value = effect->getParameter (effect, paramIndex);
 
-		printf ("Param %03d: %s [%s %s] (normalized = %f)\n", paramIndex, paramName, paramDisplay, paramLabel, value);
+		PluginParamInfo param;
+		param.name = cleanString (paramName);
+		param.label = cleanString (paramLabel);
+		param.display = cleanString (paramDisplay);
+		param.value = effect->getParameter (effect, paramIndex);
+		info.params.push_back (param);
 	}
 
-	printf ("\n");
-
 	// Can-do nonsense...
 	static const char* canDos[] =
 	{
@@ -490,11 +1486,41 @@ void checkEffectProperties (AEffect* effect)
 		"midiProgramNames"
 	};
 
-	for (VstInt32 canDoIndex = 0; canDoIndex < sizeof (canDos) / sizeof (canDos[0]); canDoIndex++)
+	info.canDos.clear ();
+	for (VstInt32 canDoIndex = 0; canDoIndex < (VstInt32)(sizeof (canDos) / sizeof (canDos[0])); canDoIndex++)
+	{
+		PluginCanDo canDo;
+		canDo.name = canDos[canDoIndex];
+		canDo.result = (VstInt32)effect->dispatcher (effect, effCanDo, 0, 0, (void*)canDos[canDoIndex], 0);
+		info.canDos.push_back (canDo);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------
+void printEffectProperties (const PluginInfo& info)
+{
+	printf ("Name = %s\nVendor = %s\nProduct = %s\n\n", info.name.c_str (), info.vendor.c_str (), info.product.c_str ());
+
+	printf ("numPrograms = %d\nnumParams = %d\nnumInputs = %d\nnumOutputs = %d\n\n", 
+			(int)info.programs.size (), (int)info.params.size (), info.numInputs, info.numOutputs);
+
+	for (size_t progIndex = 0; progIndex < info.programs.size (); progIndex++)
+		printf ("Program %03d: %s\n", (int)progIndex, info.programs[progIndex].c_str ());
+
+	printf ("\n");
+
+	for (size_t paramIndex = 0; paramIndex < info.params.size (); paramIndex++)
+	{
+		const PluginParamInfo& param = info.params[paramIndex];
+		printf ("Param %03d: %s [%s %s] (normalized = %f)\n", (int)paramIndex, param.name.c_str (), param.display.c_str (), param.label.c_str (), param.value);
+	}
+
+	printf ("\n");
+
+	for (size_t canDoIndex = 0; canDoIndex < info.canDos.size (); canDoIndex++)
 	{
-		printf ("Can do %s... ", canDos[canDoIndex]);
-		VstInt32 result = (VstInt32)effect->dispatcher (effect, effCanDo, 0, 0, (void*)canDos[canDoIndex], 0);
-		switch (result)
+		printf ("Can do %s... ", info.canDos[canDoIndex].name.c_str ());
+		switch (info.canDos[canDoIndex].result)
 		{
 			case 0  : printf ("don't know"); break;
 			case 1  : printf ("yes"); break;
@@ -516,16 +1542,15 @@ VstIntPtr VSTCALLBACK HostCallback (AEffect* effect, VstInt32 opcode, VstInt32 i
 	bool filtered = false;
 	if (opcode == audioMasterIdle)
 	{
-		static bool wasIdle = false;
-		if (wasIdle)
+		// shared by every session, so only the first idle call is printed
+		static atomic<bool> wasIdle (false);
+		if (wasIdle.exchange (true))
 			filtered = true;
 		else
-		{
 			printf ("(Future idle calls will not be displayed!)\n");
-			wasIdle = true;
-		}
 	}
 
+	(void)filtered; // for the trace below
 	//if (!filtered)
 	//	printf ("PLUG> HostCallback (opcode %d)\n index = %d, value = %p, ptr = %p, opt = %f\n", opcode, index, FromVstPtr<void> (value), ptr, opt);
 
@@ -0,0 +1,85 @@
+#ifndef MIXKERNELS_H
+#define MIXKERNELS_H
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIX_SSE 1
+#else
+#define MIX_SSE 0
+#endif
+
+///////////////////////////
+// Mix kernels
+///////////////////////////
+
+// The loops that move whole blocks of samples around: summing buses,
+// folding a plugin's outputs down to the bus and interleaving for the
+// device or a file. Four frames at a time with SSE, where the compiler
+// targets it. Buffers need no particular alignment. Each sample is added
+// on its own, so the result is the same as the plain loops bit for bit.
+
+// dst += src
+inline void MixAdd(float* dst, const float* src, unsigned long frames)
+{
+	unsigned long i = 0;
+#if MIX_SSE
+	for (; i + 4 <= frames; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+	}
+#endif
+	for (; i < frames; i++) {
+		dst[i] += src[i];
+	}
+}
+
+// Sum numIn channels into numOut, input channel i going to output
+// channel map[i], or nowhere if that is negative. Outputs nothing maps
+// to come out silent.
+inline void MixDown(float** out, int numOut, float* const* in, int numIn, const int* map, unsigned long frames)
+{
+	for (int o=0; o<numOut; o++) {
+		bool first = true;
+		for (int i=0; i<numIn; i++) {
+			if (map[i] != o) {
+				continue;
+			}
+			if (first) {
+				memcpy(out[o], in[i], frames * sizeof(float));
+				first = false;
+			}
+			else {
+				MixAdd(out[o], in[i], frames);
+			}
+		}
+		if (first) {
+			memset(out[o], 0, frames * sizeof(float));
+		}
+	}
+}
+
+// Interleave numChannels non-interleaved channels into out
+inline void Interleave(float* out, float* const* channels, int numChannels, unsigned long frames)
+{
+	unsigned long i = 0;
+#if MIX_SSE
+	if (numChannels == 2) {
+		const float* left = channels[0];
+		const float* right = channels[1];
+		for (; i + 4 <= frames; i += 4) {
+			__m128 l = _mm_loadu_ps(left + i);
+			__m128 r = _mm_loadu_ps(right + i);
+			_mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+			_mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+		}
+	}
+#endif
+	for (; i < frames; i++) {
+		for (int c=0; c<numChannels; c++) {
+			out[i * numChannels + c] = channels[c][i];
+		}
+	}
+}
+
+#endif
@@ -4,58 +4,102 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
-#include <map>
+#include <algorithm>
+#include "timeline.h"
+#include "tempomap.h"
 using namespace std;
 
-float BPM = 200;
-
 ///////////////////////////
 // Scales
 ///////////////////////////
-typedef enum
+
+// A scale as the semitones of its degrees above C, so the root is part of
+// the intervals
+struct ScaleInfo
+{
+	unsigned char numIntervals;
+	unsigned char intervals[12];
+};
+
+struct ModeInfo
 {
-	CMAJ,
-	CMIN,
-	NO_SCALE,
-} Scale;
+	const char* name;
+	unsigned char numIntervals;
+	unsigned char intervals[12];
+};
 
-const int NumScales = NO_SCALE;
+// Built-in scales are a root followed by a mode, e.g. cmaj, fsdorian, bbmin
+static const int NUM_ROOTS = 12;
+static const char* const rootNames[NUM_ROOTS] = { "c", "cs", "d", "ds", "e", "f", "fs", "g", "gs", "a", "as", "b" };
+// flat spellings of the black keys, by root
+static const char* const flatRootNames[NUM_ROOTS] = { NULL, "db", NULL, "eb", NULL, NULL, "gb", NULL, "ab", NULL, "bb", NULL };
 
-struct ScaleInfo
+// min keeps the intervals songs were written against, which have a major
+// sixth; aeolian is the natural minor
+static const int NUM_MODES = 15;
+constexpr ModeInfo modeInfo[NUM_MODES] =
 {
-	const char* Name;
-	short startMidiPitch;
-	short intervals[12];
-	short numIntervals;
+	{ "maj",        7, { 0, 2, 4, 5, 7, 9, 11 } },
+	{ "min",        7, { 0, 2, 3, 5, 7, 9, 10 } },
+	{ "ionian",     7, { 0, 2, 4, 5, 7, 9, 11 } },
+	{ "dorian",     7, { 0, 2, 3, 5, 7, 9, 10 } },
+	{ "phrygian",   7, { 0, 1, 3, 5, 7, 8, 10 } },
+	{ "lydian",     7, { 0, 2, 4, 6, 7, 9, 11 } },
+	{ "mixolydian", 7, { 0, 2, 4, 5, 7, 9, 10 } },
+	{ "aeolian",    7, { 0, 2, 3, 5, 7, 8, 10 } },
+	{ "locrian",    7, { 0, 1, 3, 5, 6, 8, 10 } },
+	{ "harmmin",    7, { 0, 2, 3, 5, 7, 8, 11 } },
+	{ "melmin",     7, { 0, 2, 3, 5, 7, 9, 11 } },
+	{ "pentmaj",    5, { 0, 2, 4, 7, 9 } },
+	{ "pentmin",    5, { 0, 3, 5, 7, 10 } },
+	{ "blues",      6, { 0, 3, 5, 6, 7, 10 } },
+	{ "chrom",     12, { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 } },
 };
 
-ScaleInfo scaleInfo[NumScales] = 
+static const int NUM_BUILTIN_SCALES = NUM_ROOTS * NUM_MODES;
+
+struct ScaleTable
 {
-	{ "cmaj", 0, { 0, 2, 4, 5, 7, 9, 11 }, 7 },
-	{ "cmin", 0, { 0, 2, 3, 5, 7, 9, 10 }, 7 },
+	ScaleInfo scales[NUM_BUILTIN_SCALES];
 };
 
-const char* GetScaleName(Scale scale)
+// Every mode transposed to every root, built by the compiler
+constexpr ScaleTable MakeScaleTable()
 {
-	return scaleInfo[scale].Name;
+	ScaleTable table = {};
+	for (int root=0; root<NUM_ROOTS; root++) {
+		for (int mode=0; mode<NUM_MODES; mode++) {
+			ScaleInfo& scale = table.scales[root * NUM_MODES + mode];
+			scale.numIntervals = modeInfo[mode].numIntervals;
+			for (int i=0; i<modeInfo[mode].numIntervals; i++) {
+				scale.intervals[i] = (unsigned char)(root + modeInfo[mode].intervals[i]);
+			}
+		}
+	}
+	return table;
 }
 
-unsigned short GetMidiPitch(Scale scale, int octave, int degree)
+constexpr ScaleTable builtinScales = MakeScaleTable();
+
+// The MIDI pitch of a scale degree, worked out once when a note is parsed.
+// Degrees are counted from 1; any other degree plays the scale's root.
+// The result is not clamped, see IsMidiPitch.
+inline int GetMidiPitch(const ScaleInfo* scale, int octave, int degree)
 {
-	const ScaleInfo* info = &scaleInfo[scale];
-	short startMidiPitch = info->startMidiPitch;
-	short midiPitch = 12 * octave + startMidiPitch;
-	if (degree >= 1 && degree <= info->numIntervals) {
-		midiPitch += info->intervals[degree-1];
+	int midiPitch = 12 * octave + scale->intervals[0];
+	if (degree >= 1 && degree <= scale->numIntervals) {
+		midiPitch = 12 * octave + scale->intervals[degree-1];
 	}
 	return midiPitch;
 }
 
+inline bool IsMidiPitch(int pitch) { return pitch >= 0 && pitch <= 127; }
+
 class Note
 {
 public:
-	Note(Scale scale, int octave, int degree, short velocity, int length) :
-		scale_(scale), octave_(octave), degree_(degree), velocity_(velocity), 
+	Note(unsigned char pitch, short velocity, int length) :
+		pitch_(pitch), velocity_(velocity), 
 		length_(length), isRest_(false), on_(true)
 	{
 	}
@@ -65,12 +109,8 @@ public:
 	~Note() {}
 
 	short GetLength() { return length_; }
-	float GetLengthInMs()
-	{
-		float BeatLength = 1 / BPM * 60000;
-		return (BeatLength * length_);
-	}
-	short GetPitch() { return GetMidiPitch(scale_, octave_, degree_); }
+	long long GetLengthInTicks() { return (long long)length_ * PPQ; }
+	unsigned char GetPitch() { return pitch_; }
 	short GetVelocity() { return velocity_; }
 	
 	void SetRest(bool b) { isRest_ = b; }
@@ -89,56 +129,60 @@ public:
 				cout << "Note ON ";
 			else
 				cout << "Note OFF ";
-			cout << GetScaleName(scale_) << " " << octave_ << " " << degree_
-				 << " " << velocity_ << " " << length_;
+			cout << (int)pitch_ << " " << velocity_ << " " << length_;
 		}
 	}
 
 private:
-	Scale scale_;
-	int octave_;
-	int degree_;
+	unsigned char pitch_; // MIDI pitch, resolved from the scale at parse time
 	short velocity_;
 	int length_;
 	bool isRest_;
 	bool on_;
 };
 
+class Pattern;
+
 class Event
 {
 public:
 	enum Type
 	{ 
-		NOTE 
+		NOTE,
+		PATTERN
 	};
 	Type type;
-	Note* note;
-
-	Event::Event() : type(NOTE), note(NULL)
+	union
 	{
-	}
-
-	Event::Event(const Event &rhs) {
-		type = rhs.type;
-		note = new Note(*rhs.note);
-	}
+		Note* note;
+		Pattern* pattern; // a nested pattern, played with its own repeat count
+	};
 
-	void Print()
+	Event() : type(NOTE), note(NULL)
 	{
-		switch(type)
-		{
-		case NOTE:
-			note->Print();	
-			break;
-		}
 	}
+
+	void Print();
 };
 
 class Pattern
 {
 public:
-	Pattern() : repeatCount_(1) {}
-	~Pattern() {}
+	Pattern() : repeatCount_(1), depth_(1) {}
+
+	// A pattern owns its notes. Nested patterns belong to the song, which
+	// is handed every pattern the parser builds.
+	~Pattern()
+	{
+		for (size_t i=0; i<events_.size(); i++) {
+			if (events_[i].type == Event::NOTE) {
+				delete events_[i].note;
+			}
+		}
+	}
+
+	Pattern(const Pattern&) = delete;
+	Pattern& operator=(const Pattern&) = delete;
 
 public:
 	void Add(Note* n)
@@ -149,15 +193,16 @@ public:
 		events_.push_back(e);
 	}
 
+	// Nested patterns are kept by reference, "[...] # N" is not copied N
+	// times. PatternIterator expands the repeats while playing.
 	void Add(Pattern* p)
 	{
-		int numEvents = p->GetNumEvents();
-		int repeat = p->GetRepeatCount();
-		for (int j=0; j<repeat; j++) {
-			for (int i=0; i<numEvents; i++) {
-				Event* e = p->GetEvent(i);
-				events_.push_back(*e);
-			}
+		Event e;
+		e.type = Event::PATTERN;
+		e.pattern = p;
+		events_.push_back(e);
+		if (p->depth_ + 1 > depth_) {
+			depth_ = p->depth_ + 1;
 		}
 	}
 
@@ -177,6 +222,11 @@ public:
 		return repeatCount_;
 	}
 
+	// How deeply patterns are nested inside this one, counting itself
+	int GetDepth() {
+		return depth_;
+	}
+
 	void Print()
 	{
 		cout << "[";
@@ -195,145 +245,393 @@ public:
 private:
 	vector<Event> events_;
 	int repeatCount_;
+	int depth_;
+};
+
+inline void Event::Print()
+{
+	switch(type)
+	{
+	case NOTE:
+		note->Print();	
+		break;
+	case PATTERN:
+		pattern->Print();
+		break;
+	}
+}
+
+// Walks the notes and rests of a pattern in playing order, expanding
+// repeats and nested patterns as it goes instead of materializing them.
+// Start reserves room for the whole nesting depth, so Next never allocates.
+class PatternIterator
+{
+public:
+	PatternIterator() {}
+
+	void Start(Pattern* pattern)
+	{
+		stack_.clear();
+		stack_.reserve(pattern->GetDepth());
+		Push(pattern);
+	}
+
+	// The next note or rest, or NULL once the pattern is done
+	Note* Next()
+	{
+		while (!stack_.empty()) {
+			Frame& frame = stack_.back();
+			if (frame.pos >= frame.pattern->GetNumEvents()) {
+				frame.pos = 0;
+				if (--frame.repeatsLeft <= 0) {
+					stack_.pop_back();
+				}
+				continue;
+			}
+			Event* e = frame.pattern->GetEvent(frame.pos++);
+			if (e->type == Event::PATTERN) {
+				Push(e->pattern);
+				continue;
+			}
+			return e->note;
+		}
+		return NULL;
+	}
+
+	bool IsDone() const { return stack_.empty(); }
+
+private:
+	void Push(Pattern* pattern)
+	{
+		if (pattern->GetRepeatCount() <= 0) {
+			return;
+		}
+		Frame frame;
+		frame.pattern = pattern;
+		frame.pos = 0;
+		frame.repeatsLeft = pattern->GetRepeatCount();
+		stack_.push_back(frame);
+	}
+
+	struct Frame
+	{
+		Pattern* pattern;
+		unsigned int pos;
+		int repeatsLeft;
+	};
+	vector<Frame> stack_;
+};
+
+// An event produced by Song::Update, offset in frames from the start of the update
+struct SongEvent
+{
+	int offset;
+	unsigned char status; // with the channel in the low bits
+	unsigned char pitch;
+	unsigned char velocity;
+};
+
+static const int SONG_MAX_EVENTS = 512;
+
+// Fixed capacity event list so Song::Update never allocates
+class SongEventBuffer
+{
+public:
+	SongEventBuffer() : numEvents_(0), numDropped_(0) {}
+
+	bool Add(int offset, unsigned char status, unsigned char pitch, unsigned char velocity)
+	{
+		if (numEvents_ >= SONG_MAX_EVENTS) {
+			numDropped_++;
+			return false;
+		}
+		SongEvent& e = events_[numEvents_++];
+		e.offset = offset;
+		e.status = status;
+		e.pitch = pitch;
+		e.velocity = velocity;
+		return true;
+	}
+
+	void Clear() { numEvents_ = 0; }
+	int GetNumEvents() const { return numEvents_; }
+	const SongEvent& GetEvent(int i) const { return events_[i]; }
+	unsigned long GetNumDropped() const { return numDropped_; }
+
+private:
+	SongEvent events_[SONG_MAX_EVENTS];
+	int numEvents_;
+	unsigned long numDropped_;
+};
+
+// The sounding notes, at most one per note key (see GetNoteKey), ordered
+// by the time they end. An occupancy bitset answers whether a key is
+// sounding and a heap indexed by key hands out the next note to end, so
+// expiring a note never visits the others.
+class ActiveNotes
+{
+public:
+	ActiveNotes() : size_(0)
+	{
+		memset(occupied_, 0, sizeof(occupied_));
+	}
+
+	bool IsEmpty() const { return size_ == 0; }
+
+	bool IsActive(int key) const
+	{
+		return (occupied_[key >> 6] >> (key & 63)) & 1;
+	}
+
+	long long GetOffTime(int key) const { return offTime_[key]; }
+
+	// Start a note, or move the end of one already sounding at this key
+	void Start(int key, long long offTime)
+	{
+		if (IsActive(key)) {
+			long long oldTime = offTime_[key];
+			offTime_[key] = offTime;
+			if (offTime < oldTime) {
+				SiftUp(heapIndex_[key]);
+			}
+			else {
+				SiftDown(heapIndex_[key]);
+			}
+			return;
+		}
+		occupied_[key >> 6] |= 1ULL << (key & 63);
+		offTime_[key] = offTime;
+		heap_[size_] = (unsigned short)key;
+		heapIndex_[key] = size_;
+		SiftUp(size_++);
+	}
+
+	long long GetFirstOffTime() const { return offTime_[heap_[0]]; }
+
+	// Remove the note that ends first and return its key
+	int RemoveFirst()
+	{
+		int key = heap_[0];
+		occupied_[key >> 6] &= ~(1ULL << (key & 63));
+		size_--;
+		if (size_ > 0) {
+			heap_[0] = heap_[size_];
+			heapIndex_[heap_[0]] = 0;
+			SiftDown(0);
+		}
+		return key;
+	}
+
+private:
+	void Swap(int a, int b)
+	{
+		unsigned short key = heap_[a];
+		heap_[a] = heap_[b];
+		heap_[b] = key;
+		heapIndex_[heap_[a]] = a;
+		heapIndex_[heap_[b]] = b;
+	}
+
+	void SiftUp(int i)
+	{
+		while (i > 0) {
+			int parent = (i - 1) / 2;
+			if (offTime_[heap_[parent]] <= offTime_[heap_[i]]) {
+				break;
+			}
+			Swap(i, parent);
+			i = parent;
+		}
+	}
+
+	void SiftDown(int i)
+	{
+		for (;;) {
+			int smallest = i;
+			int left = 2 * i + 1;
+			int right = left + 1;
+			if (left < size_ && offTime_[heap_[left]] < offTime_[heap_[smallest]]) {
+				smallest = left;
+			}
+			if (right < size_ && offTime_[heap_[right]] < offTime_[heap_[smallest]]) {
+				smallest = right;
+			}
+			if (smallest == i) {
+				break;
+			}
+			Swap(i, smallest);
+			i = smallest;
+		}
+	}
+
+	long long offTime_[MIDI_NUM_KEYS]; // sample positions
+	unsigned short heap_[MIDI_NUM_KEYS];
+	int heapIndex_[MIDI_NUM_KEYS];
+	int size_;
+	unsigned long long occupied_[MIDI_NUM_KEYS / 64];
 };
 
 class Song
 {
 public:
-	Song() {}
+	Song() : songTime_(0) {}
+
+	// Frees the patterns it was given and their notes. A compiled timeline
+	// does not point into them, so it can outlive the song.
+	~Song()
+	{
+		for (size_t i=0; i<patterns_.size(); i++) {
+			delete patterns_[i].pattern_;
+		}
+	}
+
+	Song(const Song&) = delete;
+	Song& operator=(const Song&) = delete;
 
-	void AddPattern(Pattern* p)
+	// Tempo from the start of the song, or from beat onwards
+	void SetTempo(float bpm) { tempoMap_.SetTempo(0, bpm); }
+	void AddTempoChange(long long beat, float bpm) { tempoMap_.SetTempo(beat * PPQ, bpm); }
+	float GetTempo() const { return tempoMap_.GetInitialTempo(); }
+	const TempoMap& GetTempoMap() const { return tempoMap_; }
+
+	// Rate Update counts frames at
+	void SetSampleRate(double sampleRate) { tempoMap_.SetSampleRate(sampleRate); }
+
+	void ReservePatterns(size_t numPatterns)
 	{
-		SongPattern sp(p);
-		patterns_.push_back(sp);
+		patterns_.reserve(patterns_.size() + numPatterns);
 	}
 
-	void Update(float elapsedTime, vector<Event>& events, vector<float>& offsets)
+	// Play a pattern from the start of the song on a MIDI channel, 0 to 15.
+	// The song takes ownership of it.
+	void AddPattern(Pattern* p, int channel = 0)
 	{
-		// now go through the patterns and update
+		patterns_.push_back(SongPattern(p, (unsigned char)(channel & 0x0F)));
+		// start in place, a copied iterator would lose its reserved stack
+		SongPattern& sp = patterns_.back();
+		sp.iter_.Start(p);
+		if (!sp.iter_.IsDone()) {
+			Schedule((int)patterns_.size() - 1);
+		}
+	}
+
+	// Compile the song into a timeline of note on/off events at sample
+	// positions. Times are accumulated in integer ticks and each one goes
+	// through the tempo map once, so long songs do not drift. Patterns are
+	// left untouched, so the song can be compiled again.
+	void Compile(double sampleRate, Timeline& timeline)
+	{
+		tempoMap_.SetSampleRate(sampleRate);
+
+		// collect every note with its start and end beat
+		vector<CompiledNote> notes;
 		size_t numPatterns = patterns_.size();
-		for (int i=0; i<numPatterns; i++) {
-			SongPattern* sp = &patterns_[i];
-			float timeUsed = 0;
-			while (timeUsed < elapsedTime) {
-
-				float timeUsedThisIteration = 0;
-
-				if (sp->pattern_->GetRepeatCount() > 0)
-				{
-					if (sp->pos_ >= sp->pattern_->GetNumEvents()) {
-						sp->pattern_->SetRepeatCount(sp->pattern_->GetRepeatCount() - 1);
-						sp->pos_ = 0;
-						continue;
-					}
-
-					// if there is left over time from an already encountered rest,
-					// then consume it.
-					if (sp->leftover_ > 0) 
-					{
-						if (timeUsed + sp->leftover_ > elapsedTime) {
-							unsigned long timeLeftInFrame = elapsedTime - timeUsed;
-							sp->leftover_ -= timeLeftInFrame;
-							timeUsed = elapsedTime;
-							timeUsedThisIteration = timeLeftInFrame;
-						}
-						else {
-							timeUsed += sp->leftover_;
-							timeUsedThisIteration = sp->leftover_;
-							sp->leftover_ = 0;
-							sp->pos_++;
-						}
-					}
-					else
-					{
-						Event* e = sp->pattern_->GetEvent(sp->pos_);
-						switch(e->type) 
-						{
-							case Event::NOTE:
-							{
-								Note* note = e->note;
-								if (e->note->IsRest())
-								{
-									// rest event
-									float noteLength = note->GetLengthInMs();
-									if (timeUsed + noteLength > elapsedTime) {
-										unsigned long timeLeftInFrame = elapsedTime - timeUsed;
-										sp->leftover_ = noteLength - timeLeftInFrame;
-										timeUsed = elapsedTime;
-										timeUsedThisIteration = timeLeftInFrame;
-									}
-									else {
-										timeUsed += noteLength;
-										timeUsedThisIteration = noteLength;
-										sp->pos_++;
-									}
-								}
-								else {
-									// note on event
-									map<short, ActiveNote>::iterator activeNoteIter = activeNotes_.find(note->GetPitch());
-									// search for an active note at this pitch
-									if (activeNoteIter != activeNotes_.end()) {
-										// add note off event to event list
-										Event noteOffEvent;
-										noteOffEvent.type = Event::NOTE;
-										noteOffEvent.note = new Note(*activeNoteIter->second.note);
-										noteOffEvent.note->SetNoteOff();
-										events.push_back(noteOffEvent);
-										offsets.push_back(timeUsed-1); // make sure the note off event is before the note on for the same pitch
-
-										// active note at this pitch already exists, so replace 
-										// that active note with this one
-										ActiveNote& activeNote = activeNoteIter->second;
-										activeNote.note = note;
-										activeNote.timeLeft = note->GetLengthInMs();
-									}
-									else {
-										// create a new entry in the active note list
-										ActiveNote active;
-										active.note = note;
-										active.timeLeft = note->GetLengthInMs();
-										activeNotes_[note->GetPitch()] = active;
-									}
-									events.push_back(*e);
-									offsets.push_back(timeUsed);
-									sp->pos_++;
-								}
-							}
-							default:
-								break;
-						}
-					}
-				}
-				else {
-					timeUsed = elapsedTime;
-					timeUsedThisIteration = elapsedTime;
+		for (size_t i=0; i<numPatterns; i++) {
+			PatternIterator it;
+			it.Start(patterns_[i].pattern_);
+			long long tick = 0;
+			while (Note* note = it.Next()) {
+				if (note->IsRest()) {
+					tick += note->GetLengthInTicks();
+					continue;
 				}
+				CompiledNote n;
+				n.start = tempoMap_.TickToSample(tick);
+				n.end = tempoMap_.TickToSample(tick + note->GetLengthInTicks());
+				n.channel = patterns_[i].channel_;
+				n.pitch = note->GetPitch();
+				n.velocity = (unsigned char)(note->GetVelocity() & 0x7F);
+				notes.push_back(n);
+			}
+		}
+		stable_sort(notes.begin(), notes.end());
+
+		// a note at a key that is already sounding cuts the earlier note short
+		vector<int> sounding(MIDI_NUM_KEYS, -1);
+		for (size_t i=0; i<notes.size(); i++) {
+			CompiledNote& n = notes[i];
+			if (n.end <= n.start) {
+				n.end = n.start + 1;
+			}
+			int key = (n.channel << 7) | n.pitch;
+			int prev = sounding[key];
+			if (prev >= 0 && notes[prev].end > n.start) {
+				notes[prev].end = n.start;
+			}
+			sounding[key] = (int)i;
+		}
 
-				// update active notes
-				map<short, ActiveNote>::iterator it;
-				for (it = activeNotes_.begin(); it != activeNotes_.end(); ) {
-					ActiveNote* activeNote = &it->second;
-					if (timeUsedThisIteration > activeNote->timeLeft) {
-						// generate note off event
-						Event noteOffEvent;
-						noteOffEvent.type = Event::NOTE;
-						noteOffEvent.note = new Note(*it->second.note);
-						noteOffEvent.note->SetNoteOff();
-						events.push_back(noteOffEvent);
-						offsets.push_back(activeNote->timeLeft);
-
-						// remove active note
-						map<short, ActiveNote>::iterator removeIt = it;
-						it++;
-						activeNotes_.erase(removeIt);
-					}
-					else {
-						activeNote->timeLeft -= timeUsedThisIteration;
-						it++;
-					}
-				}
+		timeline.Clear();
+		timeline.Reserve(notes.size() * 2);
+		for (size_t i=0; i<notes.size(); i++) {
+			const CompiledNote& n = notes[i];
+			if (n.end <= n.start) {
+				// struck again at the same instant, only the later note sounds
+				continue;
 			}
+			timeline.Add(n.start, MIDI_NOTE_ON | n.channel, n.pitch, n.velocity);
+			timeline.Add(n.end, MIDI_NOTE_OFF | n.channel, n.pitch, 0);
 		}
+		timeline.Sort();
+
+		// a bar for every bar start up to the end of the song
+		long long songEnd = timeline.GetNumEvents() > 0 ? timeline.GetPosition(timeline.GetNumEvents() - 1) : 0;
+		vector<long long> bars;
+		for (long long bar=0; ; bar++) {
+			long long position = tempoMap_.TickToSample(bar * BEATS_PER_BAR * PPQ);
+			if (bar > 0 && position > songEnd) {
+				break;
+			}
+			bars.push_back(position);
+		}
+		timeline.BuildIndex(bars);
+	}
+
+	// Start the song again from the top
+	void Reset()
+	{
+		while (!activeNotes_.IsEmpty()) {
+			activeNotes_.RemoveFirst();
+		}
+		schedule_.clear();
+		for (size_t i=0; i<patterns_.size(); i++) {
+			SongPattern& sp = patterns_[i];
+			sp.iter_.Start(sp.pattern_);
+			sp.nextTick_ = 0;
+			sp.nextTime_ = 0;
+			if (!sp.iter_.IsDone()) {
+				Schedule((int)i);
+			}
+		}
+		songTime_ = 0;
+	}
+
+	bool IsFinished() const { return schedule_.empty() && activeNotes_.IsEmpty(); }
+
+	// Advance the song by a number of frames, at the rate set with
+	// SetSampleRate, and collect the note on and off events that fall
+	// inside them, in time order. Patterns wait in a heap keyed by the
+	// sample position of their next event, so only the patterns that have
+	// something to play in this update are touched. Nothing here
+	// allocates, so it is safe to call from the audio thread.
+	void Update(unsigned long frames, SongEventBuffer& events)
+	{
+		long long endTime = songTime_ + frames;
+		while (!schedule_.empty() && patterns_[schedule_[0]].nextTime_ < endTime) {
+			SongPattern& sp = patterns_[schedule_[0]];
+			// notes that end by now go before anything that starts now
+			EndNotes(sp.nextTime_, true, events);
+			if (PlayPattern(sp, events)) {
+				SiftDownPattern(0);
+			}
+			else {
+				schedule_[0] = schedule_.back();
+				schedule_.pop_back();
+				SiftDownPattern(0);
+			}
+		}
+		EndNotes(endTime, false, events);
+		songTime_ = endTime;
 	}
 
 private:
@@ -341,19 +639,114 @@ private:
 	class SongPattern
 	{
 	public:
-		SongPattern(Pattern* pattern) : pos_(0), leftover_(0), pattern_(pattern) {}
+		SongPattern(Pattern* pattern, unsigned char channel) : nextTick_(0), nextTime_(0), pattern_(pattern), channel_(channel) {}
 
-		unsigned int pos_;
-		float leftover_;
+		PatternIterator iter_;
+		long long nextTick_; // tick of the next event
+		long long nextTime_; // and its sample position
 		Pattern* pattern_;
+		unsigned char channel_;
 	};
-	struct ActiveNote
+
+	// Play the events of a pattern that are due at its current time, up to
+	// the next rest. Returns false once the pattern has played all its
+	// repeats.
+	bool PlayPattern(SongPattern& sp, SongEventBuffer& events)
 	{
-		Note* note;
-		float timeLeft;
+		while (Note* note = sp.iter_.Next()) {
+			if (note->IsRest()) {
+				sp.nextTick_ += note->GetLengthInTicks();
+				sp.nextTime_ = tempoMap_.TickToSample(sp.nextTick_);
+				return true;
+			}
+
+			unsigned char pitch = note->GetPitch();
+			int key = (sp.channel_ << 7) | pitch;
+			int offset = (int)(sp.nextTime_ - songTime_);
+			if (activeNotes_.IsActive(key)) {
+				// a note is still sounding at this key, so turn it off and
+				// let this one take its place
+				events.Add(offset, MIDI_NOTE_OFF | sp.channel_, pitch, 0);
+			}
+			activeNotes_.Start(key, tempoMap_.TickToSample(sp.nextTick_ + note->GetLengthInTicks()));
+			events.Add(offset, MIDI_NOTE_ON | sp.channel_, pitch, (unsigned char)(note->GetVelocity() & 0x7F));
+		}
+		return false;
+	}
+
+	// Turn off the notes that end before time (or at it, if inclusive)
+	void EndNotes(long long time, bool inclusive, SongEventBuffer& events)
+	{
+		while (!activeNotes_.IsEmpty()) {
+			long long offTime = activeNotes_.GetFirstOffTime();
+			if (offTime > time || (offTime == time && !inclusive)) {
+				break;
+			}
+			int key = activeNotes_.RemoveFirst();
+			events.Add((int)(offTime - songTime_), MIDI_NOTE_OFF | (key >> 7), (unsigned char)(key & 0x7F), 0);
+		}
+	}
+
+	// Heap of pattern indices ordered by next event time. Patterns due at
+	// the same time play in the order they were added.
+	bool PlaysBefore(int a, int b) const
+	{
+		if (patterns_[a].nextTime_ != patterns_[b].nextTime_) {
+			return patterns_[a].nextTime_ < patterns_[b].nextTime_;
+		}
+		return a < b;
+	}
+
+	void Schedule(int pattern)
+	{
+		schedule_.push_back(pattern);
+		int i = (int)schedule_.size() - 1;
+		while (i > 0) {
+			int parent = (i - 1) / 2;
+			if (!PlaysBefore(schedule_[i], schedule_[parent])) {
+				break;
+			}
+			swap(schedule_[i], schedule_[parent]);
+			i = parent;
+		}
+	}
+
+	void SiftDownPattern(int i)
+	{
+		int size = (int)schedule_.size();
+		for (;;) {
+			int first = i;
+			int left = 2 * i + 1;
+			int right = left + 1;
+			if (left < size && PlaysBefore(schedule_[left], schedule_[first])) {
+				first = left;
+			}
+			if (right < size && PlaysBefore(schedule_[right], schedule_[first])) {
+				first = right;
+			}
+			if (first == i) {
+				break;
+			}
+			swap(schedule_[i], schedule_[first]);
+			i = first;
+		}
+	}
+
+	struct CompiledNote
+	{
+		long long start;
+		long long end;
+		unsigned char channel;
+		unsigned char pitch;
+		unsigned char velocity;
+
+		bool operator<(const CompiledNote& rhs) const { return start < rhs.start; }
 	};
 	vector<SongPattern> patterns_;
-	map<short, ActiveNote> activeNotes_;
+	vector<int> schedule_;
+	ActiveNotes activeNotes_;
+	TempoMap tempoMap_;
+	long long songTime_; // frames since the song started
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,260 @@
+// Command line player: plays a luma song in real time through an audio
+// backend. With the null or file driver the whole real-time path runs
+// without a sound card, which is what soak tests on headless machines use.
+//
+// usage: lumaplay [options] input.luma
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "minihost.h"
+
+static void PrintUsage()
+{
+	printf("usage: lumaplay [options] input.luma\n");
+	printf("  -driver <portaudio|null|file>  where the audio goes (default portaudio)\n");
+	printf("  -noninterleaved    portaudio renders straight into the device's channel buffers\n");
+	printf("  -out <file>        WAV file the file driver writes (default out.wav)\n");
+	printf("  -freewheel         null and file drivers render as fast as they can\n");
+	printf("  -rate <hz>         sample rate (default 44100)\n");
+	printf("  -buffer <frames>   frames rendered per block (default 512)\n");
+	printf("  -ahead <blocks>    render this many blocks ahead on a thread of its own (default 0: in the callback)\n");
+	printf("  -plugin <name>     VST plugin to play through, a file or a name on the search path\n");
+	printf("  -vstpath <dirs>    directories to look for plugins in before the usual ones\n");
+	printf("  -instrument <ch>=<plugin>  play MIDI channel ch (1 to 16, * for all) with a plugin or synth\n");
+	printf("  -insert <ch>=<effect>      effect plugin after the instruments on channel ch\n");
+	printf("  -master <effect>   effect plugin on the master bus, effects run in the order given\n");
+	printf("  -outmap <ch>=<list>  outputs of the instruments on channel ch to 1 (left), 2 (right) or - (none)\n");
+	printf("  -workers <n>       threads rendering instruments alongside the audio thread (default 0)\n");
+	printf("  -lookahead <frames>  send events this much earlier than the instruments' reported delay asks (default 0)\n");
+	printf("  -plugins           list the plugins on the search path and exit\n");
+	printf("  -synth             play through the built-in synth instead of a plugin\n");
+	printf("  -seconds <n>       stop after this long (default: when the song ends)\n");
+	printf("  -watch             reload the song whenever the file changes\n");
+	printf("  -nocache           always parse, do not read or write the compiled song cache\n");
+	printf("  -stats <seconds>   print audio path timing this often while playing, and at the end\n");
+	printf("  -verbose           print every event sent to the plugin\n");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* inputFile = NULL;
+	const char* outputFile = "out.wav";
+	const char* driver = "portaudio";
+	const char* pluginFile = DEFAULT_PLUGIN_PATH;
+	const char* vstPath = NULL;
+	GraphLayout layout;
+	unsigned numWorkers = 0;
+	unsigned long lookahead = 0;
+	bool listPlugins = false;
+	bool useSynth = false;
+	bool freewheel = false;
+	bool nonInterleaved = false;
+	bool watch = false;
+	bool useCache = true;
+	bool logEvents = false;
+	double sampleRate = AUDIO_SAMPLE_RATE;
+	unsigned long framesPerBuffer = AUDIO_FRAMES_PER_BUFFER;
+	double seconds = 0;
+	unsigned aheadBlocks = 0;
+	double statsSeconds = 0;
+
+	for (int i=1; i<argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-driver") == 0 && hasValue) {
+			driver = argv[++i];
+		}
+		else if (strcmp(arg, "-out") == 0 && hasValue) {
+			outputFile = argv[++i];
+		}
+		else if (strcmp(arg, "-noninterleaved") == 0) {
+			nonInterleaved = true;
+		}
+		else if (strcmp(arg, "-freewheel") == 0) {
+			freewheel = true;
+		}
+		else if (strcmp(arg, "-rate") == 0 && hasValue) {
+			sampleRate = atof(argv[++i]);
+		}
+		else if (strcmp(arg, "-buffer") == 0 && hasValue) {
+			framesPerBuffer = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "-ahead") == 0 && hasValue) {
+			aheadBlocks = (unsigned)atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-plugin") == 0 && hasValue) {
+			pluginFile = argv[++i];
+		}
+		else if (strcmp(arg, "-vstpath") == 0 && hasValue) {
+			vstPath = argv[++i];
+		}
+		else if (hasValue && layout.Parse(arg, argv[i + 1])) {
+			i++;
+		}
+		else if (strcmp(arg, "-workers") == 0 && hasValue) {
+			numWorkers = (unsigned)atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-lookahead") == 0 && hasValue) {
+			lookahead = (unsigned long)atol(argv[++i]);
+		}
+		else if (strcmp(arg, "-plugins") == 0) {
+			listPlugins = true;
+		}
+		else if (strcmp(arg, "-synth") == 0) {
+			useSynth = true;
+		}
+		else if (strcmp(arg, "-seconds") == 0 && hasValue) {
+			seconds = atof(argv[++i]);
+		}
+		else if (strcmp(arg, "-watch") == 0) {
+			watch = true;
+		}
+		else if (strcmp(arg, "-nocache") == 0) {
+			useCache = false;
+		}
+		else if (strcmp(arg, "-stats") == 0 && hasValue) {
+			statsSeconds = atof(argv[++i]);
+		}
+		else if (strcmp(arg, "-verbose") == 0) {
+			logEvents = true;
+		}
+		else if (arg[0] != '-' && !inputFile) {
+			inputFile = arg;
+		}
+		else {
+			PrintUsage();
+			return 1;
+		}
+	}
+	PluginSearchPath searchPath;
+	if (vstPath) {
+		searchPath.Clear();
+		searchPath.AddList(vstPath);
+		searchPath.AddDefaults();
+	}
+
+	if (listPlugins) {
+		// only plugins the cache does not know yet are loaded
+		string cacheFile = PluginInfoCache::GetDefaultFileName();
+		PluginInfoCache cache;
+		cache.Load(cacheFile.c_str());
+		vector<PluginInfo> plugins;
+		size_t numScanned = scanPlugins(searchPath, cache, plugins);
+		for (size_t i=0; i<plugins.size(); i++) {
+			const PluginInfo& info = plugins[i];
+			printf("%s\t%s\t%s\t%d in %d out%s\n", info.path.c_str(), info.name.c_str(), info.vendor.c_str(),
+				info.numInputs, info.numOutputs, (info.flags & effFlagsIsSynth) ? "\tsynth" : "");
+		}
+		printf("%d plugins, %d scanned\n", (int)plugins.size(), (int)numScanned);
+		if (cache.IsDirty() && !cache.Save(cacheFile.c_str())) {
+			fprintf(stderr, "Could not write plugin cache %s: %s\n", cacheFile.c_str(), strerror(errno));
+		}
+		return 0;
+	}
+
+	if (!inputFile || sampleRate <= 0 || framesPerBuffer == 0) {
+		PrintUsage();
+		return 1;
+	}
+
+	AudioBackend* backend = NULL;
+	ClockBackend* clock = NULL;
+	if (strcmp(driver, "portaudio") == 0) {
+		PortAudioBackend* portAudio = new PortAudioBackend();
+		portAudio->SetNonInterleaved(nonInterleaved);
+		backend = portAudio;
+	}
+	else if (strcmp(driver, "null") == 0) {
+		backend = clock = new NullBackend();
+	}
+	else if (strcmp(driver, "file") == 0) {
+		FileBackend* file = new FileBackend();
+		file->SetFile(outputFile);
+		backend = clock = file;
+	}
+	else {
+		fprintf(stderr, "Unknown driver: %s\n", driver);
+		return 1;
+	}
+
+	// the session renders into the ring, the device only copies out of it
+	RenderAheadBackend* ahead = NULL;
+	if (aheadBlocks > 0) {
+		ahead = new RenderAheadBackend(*backend, aheadBlocks);
+		ahead->SetWaitForData(clock && freewheel);
+	}
+
+	// sessions are large (the synth and event buffers live inline), keep it off the stack
+	Session* session = new Session();
+	session->SetAudioFormat(sampleRate, framesPerBuffer);
+	session->SetLogEvents(logEvents);
+	session->SetTelemetryDump((unsigned int)(statsSeconds * 1000));
+	session->GetPluginPath() = searchPath;
+
+	// without -instrument, one instrument plays everything
+	if (layout.instruments.empty()) {
+		layout.instruments.push_back(string("*=") + (useSynth ? "synth" : pluginFile));
+	}
+	session->SetGraphWorkers(numWorkers);
+	session->SetLookahead(lookahead);
+	if (session->Load(inputFile, useCache) != 0 || !layout.Build(*session)) {
+		delete session;
+		delete ahead;
+		delete backend;
+		return 1;
+	}
+
+	if (seconds <= 0) {
+		// the song and a couple of seconds for the releases
+		seconds = session->GetLength() / sampleRate + 2;
+	}
+
+	// with freewheel the clock runs ahead, so it is told where to stop
+	unsigned long long blocks = (unsigned long long)(seconds * sampleRate / framesPerBuffer) + 1;
+	if (clock) {
+		clock->SetRealTime(!freewheel);
+		clock->SetBlockLimit(blocks);
+	}
+
+	if (!session->StartAudio(ahead ? *ahead : *backend)) {
+		delete session;
+		delete ahead;
+		delete backend;
+		return 1;
+	}
+	if (watch) {
+		session->StartWatching(inputFile);
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	while (chrono::duration<double>(chrono::steady_clock::now() - start).count() < seconds) {
+		if (clock && clock->GetNumBlocks() >= blocks) {
+			break;
+		}
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+
+	bool ok = session->StopAudio();
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	if (clock) {
+		printf("Played %llu blocks of %lu frames in %.2f s, %llu late\n",
+			clock->GetNumBlocks(), framesPerBuffer, elapsed, clock->GetNumLate());
+	}
+	if (statsSeconds > 0) {
+		TelemetrySnapshot snapshot;
+		session->GetTelemetry(snapshot);
+		PrintTelemetry(snapshot, sampleRate);
+	}
+	if (ahead) {
+		printf("Rendered %llu blocks %u ahead, %llu underruns (%llu frames of silence)\n",
+			ahead->GetNumRendered(), aheadBlocks, ahead->GetNumUnderruns(), ahead->GetNumUnderrunFrames());
+	}
+
+	delete session;
+	delete ahead;
+	delete backend;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,498 @@
+#ifndef PLUGINCACHE_H
+#define PLUGINCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "lexer.h"
+#include "songcache.h"
+
+#if !_WIN32
+#include <dirent.h>
+#endif
+
+using namespace std;
+
+///////////////////////////
+// Plugin search path
+///////////////////////////
+
+#if _WIN32
+static const char* PLUGIN_EXTENSION = ".dll";
+static const char PLUGIN_PATH_SEPARATOR = ';';
+#elif TARGET_API_MAC_CARBON
+static const char* PLUGIN_EXTENSION = ".vst";
+static const char PLUGIN_PATH_SEPARATOR = ':';
+#else
+static const char* PLUGIN_EXTENSION = ".so";
+static const char PLUGIN_PATH_SEPARATOR = ':';
+#endif
+
+// Directories plugins are looked for in, in order. Starts out as the
+// VST_PATH environment variable followed by the platform's usual folders.
+class PluginSearchPath
+{
+public:
+	PluginSearchPath() { AddDefaults(); }
+
+	void Clear() { dirs_.clear(); }
+
+	void Add(const string& dir)
+	{
+		if (!dir.empty()) {
+			dirs_.push_back(dir);
+		}
+	}
+
+	// Add a list of directories separated by PLUGIN_PATH_SEPARATOR
+	void AddList(const char* list)
+	{
+		const char* start = list;
+		for (const char* p = list; ; p++) {
+			if (*p == PLUGIN_PATH_SEPARATOR || *p == '\0') {
+				Add(string(start, p - start));
+				if (*p == '\0') {
+					break;
+				}
+				start = p + 1;
+			}
+		}
+	}
+
+	void AddDefaults()
+	{
+		if (const char* vstPath = getenv("VST_PATH")) {
+			AddList(vstPath);
+		}
+	#if _WIN32
+		Add("C:\\Program Files\\VSTPlugins");
+		Add("C:\\Program Files\\Steinberg\\VSTPlugins");
+	#elif TARGET_API_MAC_CARBON
+		if (const char* home = getenv("HOME")) {
+			Add(string(home) + "/Library/Audio/Plug-Ins/VST");
+		}
+		Add("/Library/Audio/Plug-Ins/VST");
+	#else
+		if (const char* home = getenv("HOME")) {
+			Add(string(home) + "/.vst");
+		}
+		Add("/usr/local/lib/vst");
+		Add("/usr/lib/vst");
+	#endif
+	}
+
+	// The file a plugin name refers to: the name itself if it is a path to
+	// a file, otherwise the first directory holding name or name with
+	// PLUGIN_EXTENSION added.
+	bool Find(const char* name, string& path) const
+	{
+		if (IsFile(name)) {
+			path = name;
+			return true;
+		}
+		if (strchr(name, '/') || strchr(name, '\\')) {
+			return false;
+		}
+		for (size_t i=0; i<dirs_.size(); i++) {
+			string candidate = dirs_[i] + DIR_SEPARATOR + name;
+			if (IsFile(candidate.c_str())) {
+				path = candidate;
+				return true;
+			}
+			candidate += PLUGIN_EXTENSION;
+			if (IsFile(candidate.c_str())) {
+				path = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Every file with PLUGIN_EXTENSION in the directories
+	void List(vector<string>& paths) const
+	{
+		size_t extLength = strlen(PLUGIN_EXTENSION);
+		for (size_t i=0; i<dirs_.size(); i++) {
+			vector<string> names;
+			ListDirectory(dirs_[i], names);
+			for (size_t j=0; j<names.size(); j++) {
+				const string& name = names[j];
+				if (name.size() > extLength && name.compare(name.size() - extLength, extLength, PLUGIN_EXTENSION) == 0) {
+					paths.push_back(dirs_[i] + DIR_SEPARATOR + name);
+				}
+			}
+		}
+	}
+
+	const vector<string>& GetDirectories() const { return dirs_; }
+
+private:
+#if _WIN32
+	static const char DIR_SEPARATOR = '\\';
+#else
+	static const char DIR_SEPARATOR = '/';
+#endif
+
+	static bool IsFile(const char* path)
+	{
+		struct stat st;
+		return stat(path, &st) == 0 && (st.st_mode & S_IFMT) != S_IFDIR;
+	}
+
+	static void ListDirectory(const string& dir, vector<string>& names)
+	{
+	#if _WIN32
+		WIN32_FIND_DATAA data;
+		HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &data);
+		if (find == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		do {
+			names.push_back(data.cFileName);
+		} while (FindNextFileA(find, &data));
+		FindClose(find);
+	#else
+		DIR* d = opendir(dir.c_str());
+		if (!d) {
+			return;
+		}
+		while (struct dirent* entry = readdir(d)) {
+			names.push_back(entry->d_name);
+		}
+		closedir(d);
+	#endif
+	}
+
+	vector<string> dirs_;
+};
+
+///////////////////////////
+// Plugin info cache
+///////////////////////////
+
+struct PluginParamInfo
+{
+	string name;
+	string label;
+	string display;
+	float value;
+};
+
+struct PluginCanDo
+{
+	string name;
+	int result; // 1 yes, -1 no, 0 don't know
+};
+
+// What the properties scan finds out about a plugin, and the state of the
+// plugin file it was found in
+struct PluginInfo
+{
+	PluginInfo() : mtime(0), size(0), hash(0), uniqueID(0), version(0), flags(0),
+		numInputs(0), numOutputs(0), initialDelay(0) {}
+
+	string path;
+	long long mtime;
+	long long size;
+	unsigned long long hash; // see PluginInfoCache::HashFile
+
+	string name;
+	string vendor;
+	string product;
+	int uniqueID;
+	int version;
+	int flags;
+	int numInputs;
+	int numOutputs;
+	int initialDelay;
+	vector<string> programs;
+	vector<PluginParamInfo> params;
+	vector<PluginCanDo> canDos;
+};
+
+// Plugin info from earlier runs, kept in a text file so starting up does
+// not have to instantiate and walk every plugin again. An entry is used as
+// long as the plugin file has the same modification time and size, or,
+// when only the time moved, the same content hash.
+class PluginInfoCache
+{
+public:
+	static const int VERSION = 1;
+
+	PluginInfoCache() : dirty_(false) {}
+
+	// Read a cache file. A missing or unreadable file leaves the cache empty.
+	bool Load(const char* fileName)
+	{
+		plugins_.clear();
+		index_.clear();
+		dirty_ = false;
+		FILE* f = fopen(fileName, "rb");
+		if (!f) {
+			return false;
+		}
+		string line;
+		vector<string> fields;
+		bool ok = ReadLine(f, line) && Split(line, fields) == 2 &&
+			fields[0] == "LUMAPLUGINS" && atoi(fields[1].c_str()) == VERSION;
+		PluginInfo info;
+		bool inPlugin = false;
+		while (ok && ReadLine(f, line)) {
+			size_t n = Split(line, fields);
+			const string& key = fields[0];
+			if (key == "plugin" && n == 5) {
+				info = PluginInfo();
+				info.path = fields[1];
+				info.mtime = atoll(fields[2].c_str());
+				info.size = atoll(fields[3].c_str());
+				info.hash = strtoull(fields[4].c_str(), NULL, 16);
+				inPlugin = true;
+			}
+			else if (!inPlugin) {
+				ok = false;
+			}
+			else if (key == "info" && n == 7) {
+				info.uniqueID = atoi(fields[1].c_str());
+				info.version = atoi(fields[2].c_str());
+				info.flags = atoi(fields[3].c_str());
+				info.numInputs = atoi(fields[4].c_str());
+				info.numOutputs = atoi(fields[5].c_str());
+				info.initialDelay = atoi(fields[6].c_str());
+			}
+			else if (key == "name" && n == 2) {
+				info.name = fields[1];
+			}
+			else if (key == "vendor" && n == 2) {
+				info.vendor = fields[1];
+			}
+			else if (key == "product" && n == 2) {
+				info.product = fields[1];
+			}
+			else if (key == "program" && n == 2) {
+				info.programs.push_back(fields[1]);
+			}
+			else if (key == "param" && n == 5) {
+				PluginParamInfo param;
+				param.name = fields[1];
+				param.label = fields[2];
+				param.display = fields[3];
+				param.value = (float)atof(fields[4].c_str());
+				info.params.push_back(param);
+			}
+			else if (key == "cando" && n == 3) {
+				PluginCanDo canDo;
+				canDo.name = fields[1];
+				canDo.result = atoi(fields[2].c_str());
+				info.canDos.push_back(canDo);
+			}
+			else if (key == "end" && n == 1) {
+				Add(info);
+				inPlugin = false;
+			}
+			else {
+				ok = false;
+			}
+		}
+		fclose(f);
+		if (!ok) {
+			plugins_.clear();
+			index_.clear();
+		}
+		return ok;
+	}
+
+	// Write the cache through a temporary file, so a reader never sees half
+	// of one. Missing folders on the way to it are created, the default
+	// cache folder does not exist on a fresh system. On failure errno says
+	// why.
+	bool Save(const char* fileName)
+	{
+		CreateParentFolders(fileName);
+		string tempName = string(fileName) + ".tmp";
+		FILE* f = fopen(tempName.c_str(), "wb");
+		if (!f) {
+			return false;
+		}
+		fprintf(f, "LUMAPLUGINS\t%d\n", VERSION);
+		for (size_t i=0; i<plugins_.size(); i++) {
+			const PluginInfo& info = plugins_[i];
+			fprintf(f, "plugin\t%s\t%lld\t%lld\t%016llx\n", info.path.c_str(), info.mtime, info.size, info.hash);
+			fprintf(f, "info\t%d\t%d\t%d\t%d\t%d\t%d\n", info.uniqueID, info.version, info.flags,
+				info.numInputs, info.numOutputs, info.initialDelay);
+			fprintf(f, "name\t%s\n", info.name.c_str());
+			fprintf(f, "vendor\t%s\n", info.vendor.c_str());
+			fprintf(f, "product\t%s\n", info.product.c_str());
+			for (size_t j=0; j<info.programs.size(); j++) {
+				fprintf(f, "program\t%s\n", info.programs[j].c_str());
+			}
+			for (size_t j=0; j<info.params.size(); j++) {
+				const PluginParamInfo& param = info.params[j];
+				fprintf(f, "param\t%s\t%s\t%s\t%f\n", param.name.c_str(), param.label.c_str(), param.display.c_str(), param.value);
+			}
+			for (size_t j=0; j<info.canDos.size(); j++) {
+				fprintf(f, "cando\t%s\t%d\n", info.canDos[j].name.c_str(), info.canDos[j].result);
+			}
+			fprintf(f, "end\n");
+		}
+		bool ok = ferror(f) == 0;
+		ok = (fclose(f) == 0) && ok;
+	#if _WIN32
+		// rename does not replace an existing file here
+		remove(fileName);
+	#endif
+		if (!ok || rename(tempName.c_str(), fileName) != 0) {
+			int error = errno;
+			remove(tempName.c_str());
+			errno = error;
+			return false;
+		}
+		dirty_ = false;
+		return true;
+	}
+
+	// The cached info for a plugin file, or NULL if there is none or the
+	// file has changed since
+	const PluginInfo* Find(const string& path)
+	{
+		map<string, size_t>::iterator it = index_.find(path);
+		if (it == index_.end()) {
+			return NULL;
+		}
+		PluginInfo& info = plugins_[it->second];
+		PluginInfo current;
+		if (!Stat(path, current) || current.size != info.size) {
+			return NULL;
+		}
+		if (current.mtime != info.mtime) {
+			// touched, but maybe not changed
+			if (HashFile(path) != info.hash) {
+				return NULL;
+			}
+			info.mtime = current.mtime;
+			dirty_ = true;
+		}
+		return &info;
+	}
+
+	// Remember info, replacing anything cached for the same path. Fills in
+	// the file's state.
+	void Store(const PluginInfo& info)
+	{
+		PluginInfo stored = info;
+		Stat(info.path, stored);
+		stored.hash = HashFile(info.path);
+		Add(stored);
+		dirty_ = true;
+	}
+
+	// Changed since it was loaded or saved
+	bool IsDirty() const { return dirty_; }
+
+	static bool Stat(const string& path, PluginInfo& info)
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			return false;
+		}
+		info.mtime = (long long)st.st_mtime;
+		info.size = (long long)st.st_size;
+		return true;
+	}
+
+	// Content hash of a plugin file
+	static unsigned long long HashFile(const string& path)
+	{
+		SourceBuffer file;
+		if (!file.Open(path.c_str())) {
+			return 0;
+		}
+		return SongCache::HashSource(file.GetData(), file.GetSize());
+	}
+
+	// Where the cache lives unless a session is told otherwise: the user's
+	// cache folder, or the working folder when there is none
+	static string GetDefaultFileName()
+	{
+	#if _WIN32
+		const char* dir = getenv("LOCALAPPDATA");
+		return dir ? string(dir) + "\\luma-plugins.cache" : string("luma-plugins.cache");
+	#else
+		if (const char* dir = getenv("XDG_CACHE_HOME")) {
+			return string(dir) + "/luma-plugins.cache";
+		}
+		const char* home = getenv("HOME");
+		return home ? string(home) + "/.cache/luma-plugins.cache" : string("luma-plugins.cache");
+	#endif
+	}
+
+private:
+	// mkdir -p of the folder fileName is in. Folders that exist already are
+	// fine, anything else shows when the file is opened.
+	static void CreateParentFolders(const string& fileName)
+	{
+		for (size_t i=1; i<fileName.size(); i++) {
+			char c = fileName[i];
+	#if _WIN32
+			if ((c == '\\' || c == '/') && fileName[i - 1] != ':') {
+				CreateDirectoryA(fileName.substr(0, i).c_str(), NULL);
+			}
+	#else
+			if (c == '/') {
+				mkdir(fileName.substr(0, i).c_str(), 0755);
+			}
+	#endif
+		}
+	}
+
+	void Add(const PluginInfo& info)
+	{
+		map<string, size_t>::iterator it = index_.find(info.path);
+		if (it != index_.end()) {
+			plugins_[it->second] = info;
+			return;
+		}
+		index_[info.path] = plugins_.size();
+		plugins_.push_back(info);
+	}
+
+	static bool ReadLine(FILE* f, string& line)
+	{
+		line.clear();
+		char chunk[1024];
+		while (fgets(chunk, sizeof(chunk), f)) {
+			line += chunk;
+			if (!line.empty() && line[line.size() - 1] == '\n') {
+				line.erase(line.size() - 1);
+				return true;
+			}
+		}
+		return !line.empty();
+	}
+
+	// Tab separated fields, returns how many
+	static size_t Split(const string& line, vector<string>& fields)
+	{
+		fields.clear();
+		size_t start = 0;
+		for (;;) {
+			size_t tab = line.find('\t', start);
+			fields.push_back(line.substr(start, tab == string::npos ? string::npos : tab - start));
+			if (tab == string::npos) {
+				return fields.size();
+			}
+			start = tab + 1;
+		}
+	}
+
+	vector<PluginInfo> plugins_;
+	map<string, size_t> index_;
+	bool dirty_;
+};
+
+#endif
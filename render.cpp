@@ -0,0 +1,204 @@
+// Command line renderer: plays a luma song through a VST plugin with no
+// audio device and writes the result to a WAV or raw file.
+//
+// usage: lumarender [options] input.luma output.wav
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "render.h"
+
+static void PrintUsage()
+{
+	printf("usage: lumarender [options] input.luma output\n");
+	printf("  -plugin <name>     VST plugin to render with, a file or a name on the search path\n");
+	printf("  -vstpath <dirs>    directories to look for plugins in before the usual ones\n");
+	printf("  -instrument <ch>=<plugin>  render MIDI channel ch (1 to 16, * for all) with a plugin or synth\n");
+	printf("  -insert <ch>=<effect>      effect plugin after the instruments on channel ch\n");
+	printf("  -master <effect>   effect plugin on the master bus, effects run in the order given\n");
+	printf("  -outmap <ch>=<list>  outputs of the instruments on channel ch to 1 (left), 2 (right) or - (none)\n");
+	printf("  -workers <n>       threads rendering instruments alongside the audio thread (default 0)\n");
+	printf("  -lookahead <frames>  send events this much earlier than the instruments' reported delay asks (default 0)\n");
+	printf("  -synth             render with the built-in synth instead of a plugin\n");
+	printf("  -format <f32|s16|s24>  sample format (default f32)\n");
+	printf("  -raw               write interleaved samples with no WAV header\n");
+	printf("  -rate <hz>         sample rate (default 44100)\n");
+	printf("  -buffer <frames>   frames rendered per block (default 512)\n");
+	printf("  -start <bar>       start rendering at a bar, counted from 0\n");
+	printf("  -tail <seconds>    keep rendering after the last note (default 2)\n");
+	printf("  -nocache           always parse, do not read or write the compiled song cache\n");
+	printf("  -threads <n>       threads to parse large inputs on (default: all cores)\n");
+	printf("  -stats             print audio path timing at the end\n");
+	printf("  -verbose           print every event sent to the plugin\n");
+}
+
+int main(int argc, char* argv[])
+{
+	const char* inputFile = NULL;
+	const char* outputFile = NULL;
+	const char* pluginFile = DEFAULT_PLUGIN_PATH;
+	const char* vstPath = NULL;
+	GraphLayout layout;
+	unsigned numWorkers = 0;
+	unsigned long lookahead = 0;
+	SampleFormat format = SAMPLE_FLOAT32;
+	bool useSynth = false;
+	bool raw = false;
+	double sampleRate = AUDIO_SAMPLE_RATE;
+	unsigned long framesPerBuffer = AUDIO_FRAMES_PER_BUFFER;
+	double tailSeconds = 2;
+	long long startBar = 0;
+	bool logEvents = false;
+	bool stats = false;
+	bool useCache = true;
+	unsigned parseThreads = thread::hardware_concurrency();
+
+	for (int i=1; i<argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-plugin") == 0 && hasValue) {
+			pluginFile = argv[++i];
+		}
+		else if (strcmp(arg, "-vstpath") == 0 && hasValue) {
+			vstPath = argv[++i];
+		}
+		else if (hasValue && layout.Parse(arg, argv[i + 1])) {
+			i++;
+		}
+		else if (strcmp(arg, "-workers") == 0 && hasValue) {
+			numWorkers = (unsigned)atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-lookahead") == 0 && hasValue) {
+			lookahead = (unsigned long)atol(argv[++i]);
+		}
+		else if (strcmp(arg, "-synth") == 0) {
+			useSynth = true;
+		}
+		else if (strcmp(arg, "-format") == 0 && hasValue) {
+			const char* name = argv[++i];
+			if (strcmp(name, "f32") == 0) {
+				format = SAMPLE_FLOAT32;
+			}
+			else if (strcmp(name, "s16") == 0) {
+				format = SAMPLE_INT16;
+			}
+			else if (strcmp(name, "s24") == 0) {
+				format = SAMPLE_INT24;
+			}
+			else {
+				fprintf(stderr, "Unknown sample format: %s\n", name);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "-raw") == 0) {
+			raw = true;
+		}
+		else if (strcmp(arg, "-rate") == 0 && hasValue) {
+			sampleRate = atof(argv[++i]);
+		}
+		else if (strcmp(arg, "-buffer") == 0 && hasValue) {
+			framesPerBuffer = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "-start") == 0 && hasValue) {
+			startBar = atoll(argv[++i]);
+		}
+		else if (strcmp(arg, "-tail") == 0 && hasValue) {
+			tailSeconds = atof(argv[++i]);
+		}
+		else if (strcmp(arg, "-nocache") == 0) {
+			useCache = false;
+		}
+		else if (strcmp(arg, "-threads") == 0 && hasValue) {
+			parseThreads = (unsigned)atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "-stats") == 0) {
+			stats = true;
+		}
+		else if (strcmp(arg, "-verbose") == 0) {
+			logEvents = true;
+		}
+		else if (arg[0] != '-' && !inputFile) {
+			inputFile = arg;
+		}
+		else if (arg[0] != '-' && !outputFile) {
+			outputFile = arg;
+		}
+		else {
+			PrintUsage();
+			return 1;
+		}
+	}
+	if (!inputFile || !outputFile || sampleRate <= 0 || framesPerBuffer == 0) {
+		PrintUsage();
+		return 1;
+	}
+
+	// sessions are large (the synth and event buffers live inline), keep it off the stack
+	Session* session = new Session();
+	session->SetAudioFormat(sampleRate, framesPerBuffer);
+	session->SetLogEvents(logEvents);
+	session->SetParseThreads(parseThreads);
+	if (vstPath) {
+		PluginSearchPath& searchPath = session->GetPluginPath();
+		searchPath.Clear();
+		searchPath.AddList(vstPath);
+		searchPath.AddDefaults();
+	}
+
+	// parse input file, or map its compiled form if it has not changed
+	if (session->Load(inputFile, useCache) != 0) {
+		delete session;
+		return 1;
+	}
+
+	// without -instrument, one instrument plays everything
+	if (layout.instruments.empty()) {
+		layout.instruments.push_back(string("*=") + (useSynth ? "synth" : pluginFile));
+	}
+	session->SetGraphWorkers(numWorkers);
+	session->SetLookahead(lookahead);
+	if (!layout.Build(*session)) {
+		delete session;
+		return 1;
+	}
+
+	AudioFileWriter writer;
+	if (!writer.Open(outputFile, format, raw, AUDIO_OUTPUT_CHANNELS, sampleRate, framesPerBuffer)) {
+		fprintf(stderr, "Could not create %s\n", outputFile);
+		delete session;
+		return 1;
+	}
+
+	if (logEvents) {
+		session->StartLog();
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	bool ok = RenderOffline(*session, writer, (unsigned long)(tailSeconds * sampleRate), startBar);
+	ok = writer.Close() && ok;
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	session->StopLog();
+
+	if (writer.IsFull()) {
+		fprintf(stderr, "Stopped %s at the 4 GiB a WAV header can describe, use -raw for longer renders\n", outputFile);
+	}
+	else if (!ok) {
+		fprintf(stderr, "Failed writing %s\n", outputFile);
+	}
+	else {
+		double seconds = writer.GetFramesWritten() / sampleRate;
+		printf("Rendered %.2f s of audio in %.2f s (%.1fx real time)\n",
+			seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.0);
+	}
+	if (stats) {
+		TelemetrySnapshot snapshot;
+		session->GetTelemetry(snapshot);
+		PrintTelemetry(snapshot, sampleRate);
+	}
+
+	delete session;
+	return ok ? 0 : 1;
+}
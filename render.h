@@ -0,0 +1,43 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "minihost.h"
+#include <stdio.h>
+using namespace std;
+
+///////////////////////////
+// Offline rendering
+///////////////////////////
+
+// Render the session's compiled song through its plugin as fast as the CPU
+// allows, using the same block pipeline as the audio callback, from
+// startBar on. Keeps rendering for tailFrames after the last event so
+// releases ring out.
+bool RenderOffline(Session& session, AudioFileWriter& writer, unsigned long tailFrames, long long startBar = 0)
+{
+	float** outputs = session.GetOutputBuffers();
+	session.Rewind();
+	if (startBar > 0) {
+		session.LocateBar(startBar);
+	}
+
+	unsigned long framesPerBuffer = session.GetFramesPerBuffer();
+	while (!session.IsFinished()) {
+		session.RenderBlock(outputs, framesPerBuffer);
+		if (!writer.Write(outputs, framesPerBuffer)) {
+			return false;
+		}
+	}
+
+	while (tailFrames > 0) {
+		unsigned long frames = tailFrames < framesPerBuffer ? tailFrames : framesPerBuffer;
+		session.RenderBlock(outputs, frames);
+		if (!writer.Write(outputs, frames)) {
+			return false;
+		}
+		tailFrames -= frames;
+	}
+	return true;
+}
+
+#endif
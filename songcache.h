@@ -0,0 +1,179 @@
+#ifndef SONGCACHE_H
+#define SONGCACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "lexer.h"
+#include "timeline.h"
+using namespace std;
+
+///////////////////////////
+// Song cache
+///////////////////////////
+
+// A compiled song on disk, laid out so a mapped file can be played in place:
+// a fixed header followed by the timeline's arrays and its index, the 64
+// bit arrays first so they stay 8 byte aligned. Files are written in the machine's byte order and
+// are only reused by a build with the same version and the same source.
+static const char SONG_CACHE_MAGIC[4] = { 'L', 'U', 'M', 'C' };
+static const unsigned int SONG_CACHE_VERSION = 4;
+static const char* SONG_CACHE_EXTENSION = ".lumac";
+
+struct SongCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned long long sourceHash; // see SongCache::HashSource
+	double sampleRate;
+	float bpm;
+	unsigned int reserved;
+	unsigned long long numEvents;
+	// byte offsets of the arrays from the start of the file
+	unsigned long long positionsOffset;
+	unsigned long long statusOffset;
+	unsigned long long pitchOffset;
+	unsigned long long velocityOffset;
+	// see Timeline::BuildIndex
+	unsigned long long numBars;
+	unsigned long long barsOffset;
+	unsigned long long noteIndexSize;
+	unsigned long long noteIndexOffset;
+};
+
+class SongCache
+{
+public:
+	// Content hash of luma source. Reads eight bytes per step, so hashing
+	// is far cheaper than parsing even for very large songs.
+	static unsigned long long HashSource(const char* data, size_t size)
+	{
+		unsigned long long hash = 14695981039346656037ull ^ size;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			unsigned long long word;
+			memcpy(&word, data + i, 8);
+			hash = Mix(hash ^ word);
+		}
+		unsigned long long last = 0;
+		if (i < size) {
+			memcpy(&last, data + i, size - i);
+		}
+		return Mix(hash ^ last);
+	}
+
+	// Map a cache file and point the timeline at the arrays in it. Fails,
+	// leaving the timeline alone, if the file is missing, from another
+	// version, or was compiled from different source or settings. The
+	// timeline stays valid until the cache is closed or loaded again.
+	bool Load(const char* fileName, unsigned long long sourceHash, double sampleRate, float bpm, Timeline& timeline)
+	{
+		if (!file_.Open(fileName)) {
+			return false;
+		}
+		const char* data = file_.GetData();
+		size_t size = file_.GetSize();
+		SongCacheHeader header;
+		if (size < sizeof(header)) {
+			file_.Close();
+			return false;
+		}
+		memcpy(&header, data, sizeof(header));
+		if (memcmp(header.magic, SONG_CACHE_MAGIC, 4) != 0 ||
+			header.version != SONG_CACHE_VERSION ||
+			header.sourceHash != sourceHash ||
+			header.sampleRate != sampleRate ||
+			header.bpm != bpm ||
+			!Fits(header.positionsOffset, header.numEvents * sizeof(long long), size) ||
+			!Fits(header.statusOffset, header.numEvents, size) ||
+			!Fits(header.pitchOffset, header.numEvents, size) ||
+			!Fits(header.velocityOffset, header.numEvents, size) ||
+			!Fits(header.barsOffset, header.numBars * sizeof(long long), size) ||
+			!Fits(header.noteIndexOffset, header.noteIndexSize, size) ||
+			header.positionsOffset % sizeof(long long) != 0 ||
+			header.barsOffset % sizeof(long long) != 0) {
+			file_.Close();
+			return false;
+		}
+		timeline.View((const long long*)(data + header.positionsOffset),
+			(const unsigned char*)(data + header.statusOffset),
+			(const unsigned char*)(data + header.pitchOffset),
+			(const unsigned char*)(data + header.velocityOffset),
+			(size_t)header.numEvents);
+		timeline.ViewIndex((const unsigned char*)(data + header.noteIndexOffset), (size_t)header.noteIndexSize,
+			(const long long*)(data + header.barsOffset), (size_t)header.numBars);
+		return true;
+	}
+
+	void Close() { file_.Close(); }
+
+	// Write a compiled timeline out. The file is written under a temporary
+	// name and renamed into place, so a reader never maps half a file.
+	static bool Save(const char* fileName, unsigned long long sourceHash, double sampleRate, float bpm, const Timeline& timeline)
+	{
+		unsigned long long numEvents = timeline.GetNumEvents();
+		SongCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SONG_CACHE_MAGIC, 4);
+		header.version = SONG_CACHE_VERSION;
+		header.sourceHash = sourceHash;
+		header.sampleRate = sampleRate;
+		header.bpm = bpm;
+		header.numEvents = numEvents;
+		header.numBars = timeline.GetNumBars();
+		header.noteIndexSize = timeline.GetNoteIndexSize();
+		header.positionsOffset = sizeof(header);
+		header.barsOffset = header.positionsOffset + numEvents * sizeof(long long);
+		header.statusOffset = header.barsOffset + header.numBars * sizeof(long long);
+		header.pitchOffset = header.statusOffset + numEvents;
+		header.velocityOffset = header.pitchOffset + numEvents;
+		header.noteIndexOffset = header.velocityOffset + numEvents;
+
+		string tempName = string(fileName) + ".tmp";
+		FILE* f = fopen(tempName.c_str(), "wb");
+		if (!f) {
+			return false;
+		}
+		bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+		if (numEvents > 0) {
+			ok = ok && fwrite(timeline.GetPositions(), sizeof(long long), numEvents, f) == numEvents;
+		}
+		if (header.numBars > 0) {
+			ok = ok && fwrite(timeline.GetBars(), sizeof(long long), header.numBars, f) == header.numBars;
+		}
+		if (numEvents > 0) {
+			ok = ok && fwrite(timeline.GetStatuses(), 1, numEvents, f) == numEvents;
+			ok = ok && fwrite(timeline.GetPitches(), 1, numEvents, f) == numEvents;
+			ok = ok && fwrite(timeline.GetVelocities(), 1, numEvents, f) == numEvents;
+		}
+		if (header.noteIndexSize > 0) {
+			ok = ok && fwrite(timeline.GetNoteIndex(), 1, header.noteIndexSize, f) == header.noteIndexSize;
+		}
+		ok = (fclose(f) == 0) && ok;
+	#if _WIN32
+		// rename does not replace an existing file here
+		remove(fileName);
+	#endif
+		if (!ok || rename(tempName.c_str(), fileName) != 0) {
+			remove(tempName.c_str());
+			return false;
+		}
+		return true;
+	}
+
+private:
+	static unsigned long long Mix(unsigned long long h)
+	{
+		h *= 0x100000001b3ull;
+		return h ^ (h >> 29);
+	}
+
+	static bool Fits(unsigned long long offset, unsigned long long length, size_t size)
+	{
+		return offset <= size && length <= size - offset;
+	}
+
+	SourceBuffer file_;
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <string.h>
+#include <string_view>
+#include <vector>
+#include "music.h"
+#include "lexer.h"
+using namespace std;
+
+typedef double (*func_t) (double);
+
+/* A symbol. Names are interned, so a symbol's name is shared with its
+   hash table slot.  */
+struct symrec
+{
+	const char *name;  /* name of symbol */
+	unsigned int length;
+	unsigned int hash;
+	int type;    /* type of symbol: either VAR or FNCT */
+	union
+	{
+		double var;      /* value of a VAR */
+		func_t fnctptr;  /* value of a FNCT */
+		const ScaleInfo *scale;  /* value of a SCALE */
+	} value;
+	int line;  /* where a scale was defined, 0 for the builtins */
+	struct symrec *replaced;  /* the earlier definition of that scale */
+};
+
+typedef struct symrec symrec;
+
+///////////////////////////
+// Arena
+///////////////////////////
+
+// Bump allocator for symbols and their names. Everything lives until the
+// arena is destroyed, so there is no per-symbol malloc or free.
+class Arena
+{
+public:
+	static const size_t BLOCK_SIZE = 64 * 1024;
+
+	Arena() : pos_(NULL), end_(NULL) {}
+	~Arena()
+	{
+		for (size_t i=0; i<blocks_.size(); i++) {
+			delete[] blocks_[i];
+		}
+	}
+
+	void* Allocate(size_t size)
+	{
+		// keep everything pointer aligned
+		size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+		if (pos_ == NULL || (size_t)(end_ - pos_) < size) {
+			size_t blockSize = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+			char* block = new char[blockSize];
+			blocks_.push_back(block);
+			pos_ = block;
+			end_ = block + blockSize;
+		}
+		void* p = pos_;
+		pos_ += size;
+		return p;
+	}
+
+	const char* Intern(string_view s)
+	{
+		char* p = (char*)Allocate(s.size() + 1);
+		memcpy(p, s.data(), s.size());
+		p[s.size()] = '\0';
+		return p;
+	}
+
+private:
+	vector<char*> blocks_;
+	char* pos_;
+	char* end_;
+};
+
+///////////////////////////
+// Symbol table
+///////////////////////////
+
+// Open addressing hash table from name to symbol. Each name gets one slot
+// for good, so a lookup is a single probe sequence however many symbols
+// there are.
+//
+// A table can fall back on a base table for names it does not have, so
+// the builtins and the song's scales are set up once and shared by the
+// chunks of a parallel parse. The base is only read, and a chunk only sees
+// the scales defined above its first line.
+class SymbolTable
+{
+public:
+	SymbolTable() : numSlots_(0), numUsed_(0), base_(NULL), baseLine_(0)
+	{
+		Rehash(256);
+	}
+
+	// Look up names this table does not have in base, as it stood before
+	// line. base must not change while this table is in use.
+	void SetBase(SymbolTable* base, int line)
+	{
+		base_ = base;
+		baseLine_ = line;
+	}
+
+	// The symbol with this name, or NULL
+	symrec* Lookup(string_view name, unsigned int hash)
+	{
+		Slot& slot = Find(name, hash);
+		if (slot.name) {
+			return slot.sym;
+		}
+		if (!base_) {
+			return NULL;
+		}
+		symrec* sym = base_->Lookup(name, hash);
+		while (sym && sym->line >= baseLine_) {
+			sym = sym->replaced;
+		}
+		return sym;
+	}
+
+	symrec* Lookup(string_view name)
+	{
+		return Lookup(name, LumaLexer::Hash(name));
+	}
+
+	// Add a symbol, replacing any earlier one of that name
+	symrec* Define(string_view name, unsigned int hash, int type)
+	{
+		if ((numUsed_ + 1) * 2 > numSlots_) {
+			Rehash(numSlots_ * 2);
+		}
+		Slot& slot = Find(name, hash);
+		if (!slot.name) {
+			slot.name = arena_.Intern(name);
+			slot.length = (unsigned int)name.size();
+			slot.hash = hash;
+			slot.sym = NULL;
+			numUsed_++;
+		}
+
+		symrec* sym = (symrec*)arena_.Allocate(sizeof(symrec));
+		sym->name = slot.name;
+		sym->length = slot.length;
+		sym->hash = hash;
+		sym->type = type;
+		sym->value.var = 0; /* Set value to 0 even if fctn.  */
+		sym->line = 0;
+		sym->replaced = NULL;
+		slot.sym = sym;
+		return sym;
+	}
+
+	symrec* Define(string_view name, int type)
+	{
+		return Define(name, LumaLexer::Hash(name), type);
+	}
+
+private:
+	struct Slot
+	{
+		const char* name; // NULL while the slot is empty
+		unsigned int length;
+		unsigned int hash;
+		symrec* sym;
+	};
+
+	// The slot holding this name, or the empty slot where it belongs
+	Slot& Find(string_view name, unsigned int hash)
+	{
+		size_t mask = numSlots_ - 1;
+		for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+			Slot& slot = slots_[i];
+			if (!slot.name) {
+				return slot;
+			}
+			if (slot.hash == hash && slot.length == name.size() &&
+				memcmp(slot.name, name.data(), name.size()) == 0) {
+				return slot;
+			}
+		}
+	}
+
+	void Rehash(size_t numSlots)
+	{
+		vector<Slot> old;
+		old.swap(slots_);
+		Slot empty = { NULL, 0, 0, NULL };
+		slots_.assign(numSlots, empty);
+		numSlots_ = numSlots;
+		for (size_t i=0; i<old.size(); i++) {
+			if (old[i].name) {
+				Find(string_view(old[i].name, old[i].length), old[i].hash) = old[i];
+			}
+		}
+	}
+
+	vector<Slot> slots_;
+	size_t numSlots_; // always a power of 2
+	size_t numUsed_;
+	SymbolTable* base_;
+	int baseLine_;
+	Arena arena_;
+};
+
+#endif
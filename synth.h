@@ -0,0 +1,502 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include "pluginterfaces/vst2.x/aeffectx.h"
+#include "timeline.h"
+#include "midievents.h"
+#include <math.h>
+#include <string.h>
+
+// Pick the widest vector unit the compiler targets. Voices are processed
+// SYNTH_LANES at a time. Builds target SSE2 unless asked for more, see SIMD
+// in build/Makefile and LumaSimd in build/minihost.vcxproj.
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define SYNTH_LANES 16
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define SYNTH_LANES 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SYNTH_LANES 4
+#else
+#define SYNTH_LANES 1
+#endif
+
+///////////////////////////
+// Voice vector
+///////////////////////////
+
+// The handful of float operations the voice loop needs, for one voice
+struct ScalarVec
+{
+	float v;
+	ScalarVec() {}
+	ScalarVec(float x) : v(x) {}
+	static ScalarVec Set(float x) { return x; }
+	static ScalarVec Load(const float* p) { return *p; }
+	void Store(float* p) const { *p = v; }
+	friend ScalarVec operator+(ScalarVec a, ScalarVec b) { return a.v + b.v; }
+	friend ScalarVec operator-(ScalarVec a, ScalarVec b) { return a.v - b.v; }
+	friend ScalarVec operator*(ScalarVec a, ScalarVec b) { return a.v * b.v; }
+	static ScalarVec Abs(ScalarVec a) { return fabsf(a.v); }
+	static ScalarVec SubIfGreaterEqual(ScalarVec a, ScalarVec b) { return a.v >= b.v ? a.v - b.v : a.v; }
+	float Sum() const { return v; }
+};
+
+#if SYNTH_LANES == 1
+typedef ScalarVec VoiceVec;
+#else
+// The same over one register of SYNTH_LANES voices
+struct VoiceVec
+{
+#if SYNTH_LANES == 16
+	__m512 v;
+	VoiceVec() {}
+	VoiceVec(__m512 x) : v(x) {}
+	static VoiceVec Set(float x) { return _mm512_set1_ps(x); }
+	static VoiceVec Load(const float* p) { return _mm512_load_ps(p); }
+	void Store(float* p) const { _mm512_store_ps(p, v); }
+	friend VoiceVec operator+(VoiceVec a, VoiceVec b) { return _mm512_add_ps(a.v, b.v); }
+	friend VoiceVec operator-(VoiceVec a, VoiceVec b) { return _mm512_sub_ps(a.v, b.v); }
+	friend VoiceVec operator*(VoiceVec a, VoiceVec b) { return _mm512_mul_ps(a.v, b.v); }
+	static VoiceVec Abs(VoiceVec a) { return _mm512_abs_ps(a.v); }
+	// a - b wherever a >= b
+	static VoiceVec SubIfGreaterEqual(VoiceVec a, VoiceVec b)
+	{
+		return _mm512_mask_sub_ps(a.v, _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ), a.v, b.v);
+	}
+	float Sum() const { return _mm512_reduce_add_ps(v); }
+#elif SYNTH_LANES == 8
+	__m256 v;
+	VoiceVec() {}
+	VoiceVec(__m256 x) : v(x) {}
+	static VoiceVec Set(float x) { return _mm256_set1_ps(x); }
+	static VoiceVec Load(const float* p) { return _mm256_load_ps(p); }
+	void Store(float* p) const { _mm256_store_ps(p, v); }
+	friend VoiceVec operator+(VoiceVec a, VoiceVec b) { return _mm256_add_ps(a.v, b.v); }
+	friend VoiceVec operator-(VoiceVec a, VoiceVec b) { return _mm256_sub_ps(a.v, b.v); }
+	friend VoiceVec operator*(VoiceVec a, VoiceVec b) { return _mm256_mul_ps(a.v, b.v); }
+	static VoiceVec Abs(VoiceVec a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+	static VoiceVec SubIfGreaterEqual(VoiceVec a, VoiceVec b)
+	{
+		__m256 mask = _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ);
+		return _mm256_sub_ps(a.v, _mm256_and_ps(mask, b.v));
+	}
+	float Sum() const
+	{
+		__m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+		x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+		x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+		return _mm_cvtss_f32(x);
+	}
+#elif SYNTH_LANES == 4
+	__m128 v;
+	VoiceVec() {}
+	VoiceVec(__m128 x) : v(x) {}
+	static VoiceVec Set(float x) { return _mm_set1_ps(x); }
+	static VoiceVec Load(const float* p) { return _mm_load_ps(p); }
+	void Store(float* p) const { _mm_store_ps(p, v); }
+	friend VoiceVec operator+(VoiceVec a, VoiceVec b) { return _mm_add_ps(a.v, b.v); }
+	friend VoiceVec operator-(VoiceVec a, VoiceVec b) { return _mm_sub_ps(a.v, b.v); }
+	friend VoiceVec operator*(VoiceVec a, VoiceVec b) { return _mm_mul_ps(a.v, b.v); }
+	static VoiceVec Abs(VoiceVec a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+	static VoiceVec SubIfGreaterEqual(VoiceVec a, VoiceVec b)
+	{
+		return _mm_sub_ps(a.v, _mm_and_ps(_mm_cmpge_ps(a.v, b.v), b.v));
+	}
+	float Sum() const
+	{
+		__m128 x = _mm_add_ps(v, _mm_movehl_ps(v, v));
+		x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+		return _mm_cvtss_f32(x);
+	}
+#endif
+};
+#endif
+
+///////////////////////////
+// Built-in synth
+///////////////////////////
+
+// A polyphonic sine synth built into the host. It presents itself as an
+// AEffect, so the host drives it exactly like a loaded plugin: MIDI goes
+// in through effProcessEvents and audio comes out of processReplacing.
+// Useful for deterministic renders, benchmarks, and machines without
+// plugins.
+class SimdSynth
+{
+public:
+	static const int NUM_VOICES = 64;
+	static const int NUM_GROUPS = NUM_VOICES / SYNTH_LANES;
+	// a full MidiEventBatch and an all notes off for every channel
+	static const int MAX_PENDING_EVENTS = VST_MAX_EVENTS + MIDI_CHANNELS;
+	// frames RenderVoices mixes at a time
+	static const int RENDER_CHUNK = 64;
+
+	SimdSynth() : sampleRate_(44100), scalar_(false), numPending_(0), numDropped_(0), age_(0)
+	{
+		memset(&effect_, 0, sizeof(effect_));
+		effect_.magic = kEffectMagic;
+		effect_.dispatcher = Dispatcher;
+		effect_.process = ProcessReplacing;
+		effect_.setParameter = SetParameter;
+		effect_.getParameter = GetParameter;
+		effect_.numPrograms = 0;
+		effect_.numParams = 0;
+		effect_.numInputs = 0;
+		effect_.numOutputs = 2;
+		effect_.flags = effFlagsCanReplacing | effFlagsIsSynth;
+		effect_.object = this;
+		effect_.uniqueID = CCONST('L', 'u', 'S', 'y');
+		effect_.version = 1;
+		effect_.processReplacing = ProcessReplacing;
+
+		AllNotesOff();
+		SetSampleRate(sampleRate_);
+	}
+
+	AEffect* GetEffect() { return &effect_; }
+
+	// Events that arrived after a block's queue was full
+	unsigned long GetNumDropped() const { return numDropped_; }
+
+	// Render one voice at a time with plain floats rather than SYNTH_LANES
+	// at once. The output only differs by the order voices are summed in;
+	// lumabench -verify compares the two.
+	void SetScalar(bool scalar) { scalar_ = scalar; }
+
+private:
+	void SetSampleRate(float sampleRate)
+	{
+		sampleRate_ = sampleRate;
+		// one pole envelope coefficients for a 5 ms attack and 250 ms release
+		attackRate_ = 1.0f - expf(-1.0f / (0.005f * sampleRate_));
+		releaseRate_ = 1.0f - expf(-1.0f / (0.25f * sampleRate_));
+	}
+
+	void AllNotesOff()
+	{
+		for (int i=0; i<NUM_VOICES; i++) {
+			phase_[i] = 0;
+			phaseInc_[i] = 0;
+			env_[i] = 0;
+			envTarget_[i] = 0;
+			envRate_[i] = 0;
+			gain_[i] = 0;
+			pitch_[i] = -1;
+			channel_[i] = 0;
+			voiceAge_[i] = 0;
+		}
+		for (int g=0; g<NUM_GROUPS; g++) {
+			groupActive_[g] = 0;
+		}
+		numPending_ = 0;
+	}
+
+	// Keep the block's MIDI until processReplacing, where each event is
+	// applied at its deltaFrames
+	void QueueEvents(VstEvents* events)
+	{
+		for (VstInt32 i=0; i<events->numEvents; i++) {
+			VstEvent* e = events->events[i];
+			if (e->type != kVstMidiType) {
+				continue;
+			}
+			if (numPending_ == MAX_PENDING_EVENTS) {
+				numDropped_++;
+				continue;
+			}
+			VstMidiEvent* midi = (VstMidiEvent*)e;
+			PendingEvent& p = pending_[numPending_++];
+			p.deltaFrames = midi->deltaFrames;
+			p.status = (unsigned char)(midi->midiData[0] & 0xF0);
+			p.channel = (unsigned char)(midi->midiData[0] & 0x0F);
+			p.pitch = (unsigned char)(midi->midiData[1] & 0x7F);
+			p.velocity = (unsigned char)(midi->midiData[2] & 0x7F);
+		}
+	}
+
+	// Voices are keyed by channel and pitch, so the same note on two
+	// channels routed here sounds twice
+	void NoteOn(int channel, int pitch, int velocity)
+	{
+		if (velocity == 0) {
+			NoteOff(channel, pitch);
+			return;
+		}
+		// retrigger a voice already on this note, else take a free voice,
+		// else steal the oldest one
+		int voice = -1;
+		for (int i=0; i<NUM_VOICES && voice < 0; i++) {
+			if (pitch_[i] == pitch && channel_[i] == channel) {
+				voice = i;
+			}
+		}
+		for (int i=0; i<NUM_VOICES && voice < 0; i++) {
+			if (pitch_[i] < 0) {
+				voice = i;
+			}
+		}
+		if (voice < 0) {
+			voice = 0;
+			for (int i=1; i<NUM_VOICES; i++) {
+				if (voiceAge_[i] < voiceAge_[voice]) {
+					voice = i;
+				}
+			}
+		}
+
+		float frequency = 440.0f * powf(2.0f, (pitch - 69) / 12.0f);
+		pitch_[voice] = pitch;
+		channel_[voice] = (unsigned char)channel;
+		voiceAge_[voice] = ++age_;
+		phaseInc_[voice] = frequency / sampleRate_;
+		gain_[voice] = velocity / 127.0f * 0.25f;
+		envTarget_[voice] = 1.0f;
+		envRate_[voice] = attackRate_;
+		groupActive_[voice / SYNTH_LANES] = 1;
+	}
+
+	void NoteOff(int channel, int pitch)
+	{
+		for (int i=0; i<NUM_VOICES; i++) {
+			if (pitch_[i] == pitch && channel_[i] == channel && envTarget_[i] > 0) {
+				envTarget_[i] = 0;
+				envRate_[i] = releaseRate_;
+			}
+		}
+	}
+
+	// Release every held note on a channel, for an all notes off
+	void ReleaseChannel(int channel)
+	{
+		for (int i=0; i<NUM_VOICES; i++) {
+			if (pitch_[i] >= 0 && channel_[i] == channel && envTarget_[i] > 0) {
+				envTarget_[i] = 0;
+				envRate_[i] = releaseRate_;
+			}
+		}
+	}
+
+	// One sample of a group of voices, before gain
+	template <class Vec>
+	static Vec NextSample(Vec& phase, Vec phaseInc, Vec& env, Vec envTarget, Vec envRate)
+	{
+		const Vec one = Vec::Set(1.0f);
+		const Vec two = Vec::Set(2.0f);
+		const Vec four = Vec::Set(4.0f);
+		const Vec precision = Vec::Set(0.225f);
+
+		phase = Vec::SubIfGreaterEqual(phase + phaseInc, one);
+
+		// parabolic sine: t in [-1, 1) maps to -sin(pi * t)
+		Vec t = phase * two - one;
+		Vec y = four * t * (Vec::Abs(t) - one);
+		y = precision * (y * Vec::Abs(y) - y) + y;
+
+		env = env + (envTarget - env) * envRate;
+		return y * env;
+	}
+
+	void RenderVoices(float* out, VstInt32 start, VstInt32 end)
+	{
+		if (scalar_) {
+			RenderVoicesAs<ScalarVec, 1>(out, start, end);
+		}
+		else {
+			RenderVoicesAs<VoiceVec, SYNTH_LANES>(out, start, end);
+		}
+	}
+
+	// Mix all active voices into out[start, end), Lanes voices at a time.
+	// The voices are summed lane by lane into mix, so each sample takes one
+	// horizontal add however many groups are playing.
+	template <class Vec, int Lanes>
+	void RenderVoicesAs(float* out, VstInt32 start, VstInt32 end)
+	{
+		int active[NUM_VOICES];
+		int numActive = 0;
+		for (int g=0; g<NUM_GROUPS; g++) {
+			if (groupActive_[g]) {
+				for (int i=0; i<SYNTH_LANES; i+=Lanes) {
+					active[numActive++] = g * SYNTH_LANES + i;
+				}
+			}
+		}
+		if (numActive == 0) {
+			return;
+		}
+
+		Vec mix[RENDER_CHUNK];
+		for (VstInt32 chunk=start; chunk<end; chunk+=RENDER_CHUNK) {
+			int numFrames = end - chunk < RENDER_CHUNK ? end - chunk : RENDER_CHUNK;
+			for (int a=0; a<numActive; a++) {
+				int base = active[a];
+				Vec phase = Vec::Load(&phase_[base]);
+				Vec phaseInc = Vec::Load(&phaseInc_[base]);
+				Vec env = Vec::Load(&env_[base]);
+				Vec envTarget = Vec::Load(&envTarget_[base]);
+				Vec envRate = Vec::Load(&envRate_[base]);
+				Vec gain = Vec::Load(&gain_[base]);
+
+				// the first group sets mix, the rest add to it
+				if (a == 0) {
+					for (int i=0; i<numFrames; i++) {
+						mix[i] = NextSample(phase, phaseInc, env, envTarget, envRate) * gain;
+					}
+				}
+				else {
+					for (int i=0; i<numFrames; i++) {
+						mix[i] = mix[i] + NextSample(phase, phaseInc, env, envTarget, envRate) * gain;
+					}
+				}
+
+				phase.Store(&phase_[base]);
+				env.Store(&env_[base]);
+			}
+
+			for (int i=0; i<numFrames; i++) {
+				out[chunk + i] += mix[i].Sum();
+			}
+		}
+	}
+
+	// Free voices whose release has died away and mark idle groups
+	void ReleaseVoices()
+	{
+		for (int g=0; g<NUM_GROUPS; g++) {
+			if (!groupActive_[g]) {
+				continue;
+			}
+			bool active = false;
+			for (int i=g*SYNTH_LANES; i<(g+1)*SYNTH_LANES; i++) {
+				if (pitch_[i] < 0) {
+					continue;
+				}
+				if (envTarget_[i] == 0 && env_[i] < 1e-4f) {
+					env_[i] = 0;
+					gain_[i] = 0;
+					phaseInc_[i] = 0;
+					pitch_[i] = -1;
+				}
+				else {
+					active = true;
+				}
+			}
+			groupActive_[g] = active;
+		}
+	}
+
+	void Process(float** outputs, VstInt32 sampleFrames)
+	{
+		float* left = outputs[0];
+		float* right = outputs[1];
+		memset(left, 0, sampleFrames * sizeof(float));
+
+		// render up to each event, then apply it
+		VstInt32 pos = 0;
+		for (int e=0; e<numPending_; e++) {
+			const PendingEvent& p = pending_[e];
+			VstInt32 at = p.deltaFrames;
+			if (at > sampleFrames) {
+				at = sampleFrames;
+			}
+			if (at > pos) {
+				RenderVoices(left, pos, at);
+				pos = at;
+			}
+			if (p.status == MIDI_NOTE_ON) {
+				NoteOn(p.channel, p.pitch, p.velocity);
+			}
+			else if (p.status == MIDI_NOTE_OFF) {
+				NoteOff(p.channel, p.pitch);
+			}
+			else if (p.status == MIDI_CONTROL_CHANGE && p.pitch == MIDI_ALL_NOTES_OFF) {
+				ReleaseChannel(p.channel);
+			}
+		}
+		numPending_ = 0;
+		RenderVoices(left, pos, sampleFrames);
+		ReleaseVoices();
+
+		memcpy(right, left, sampleFrames * sizeof(float));
+	}
+
+	static SimdSynth* FromEffect(AEffect* effect) { return (SimdSynth*)effect->object; }
+
+	static VstIntPtr VSTCALLBACK Dispatcher(AEffect* effect, VstInt32 opcode, VstInt32 index, VstIntPtr value, void* ptr, float opt)
+	{
+		SimdSynth* synth = FromEffect(effect);
+		switch (opcode)
+		{
+			case effSetSampleRate :
+				synth->SetSampleRate(opt);
+				return 1;
+			case effMainsChanged :
+				if (value == 0)
+					synth->AllNotesOff();
+				return 1;
+			case effProcessEvents :
+				synth->QueueEvents((VstEvents*)ptr);
+				return 1;
+			case effGetEffectName :
+			case effGetProductString :
+				strcpy((char*)ptr, "Luma Synth");
+				return 1;
+			case effGetVendorString :
+				strcpy((char*)ptr, "Luma");
+				return 1;
+			case effCanDo :
+				if (strcmp((const char*)ptr, "receiveVstEvents") == 0 ||
+					strcmp((const char*)ptr, "receiveVstMidiEvent") == 0)
+					return 1;
+				return -1;
+			case effGetVstVersion :
+				return kVstVersion;
+		}
+		return 0;
+	}
+
+	static void VSTCALLBACK ProcessReplacing(AEffect* effect, float** inputs, float** outputs, VstInt32 sampleFrames)
+	{
+		FromEffect(effect)->Process(outputs, sampleFrames);
+	}
+
+	static void VSTCALLBACK SetParameter(AEffect* effect, VstInt32 index, float value) {}
+	static float VSTCALLBACK GetParameter(AEffect* effect, VstInt32 index) { return 0; }
+
+	struct PendingEvent
+	{
+		VstInt32 deltaFrames;
+		unsigned char status;
+		unsigned char channel;
+		unsigned char pitch; // or the controller number
+		unsigned char velocity;
+	};
+
+	AEffect effect_;
+	float sampleRate_;
+	bool scalar_;
+	float attackRate_;
+	float releaseRate_;
+
+	// voice state, one array per field so a group of voices loads as a vector
+	alignas(64) float phase_[NUM_VOICES];
+	alignas(64) float phaseInc_[NUM_VOICES];
+	alignas(64) float env_[NUM_VOICES];
+	alignas(64) float envTarget_[NUM_VOICES];
+	alignas(64) float envRate_[NUM_VOICES];
+	alignas(64) float gain_[NUM_VOICES];
+	int pitch_[NUM_VOICES];
+	unsigned char channel_[NUM_VOICES];
+	unsigned int voiceAge_[NUM_VOICES];
+	char groupActive_[NUM_GROUPS];
+
+	PendingEvent pending_[MAX_PENDING_EVENTS];
+	int numPending_;
+	unsigned long numDropped_;
+	unsigned int age_;
+};
+
+#endif
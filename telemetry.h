@@ -0,0 +1,192 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+using namespace std;
+
+///////////////////////////
+// Telemetry
+///////////////////////////
+
+// Where the audio path spends its time. Stages can run on the audio thread
+// and on graph workers at once, so every counter is an atomic updated with
+// relaxed adds; nothing on the audio path locks, allocates or prints.
+enum TelemetryStage
+{
+	STAGE_SCHEDULE,	// transport, reloads and queueing the block's events
+	STAGE_DISPATCH,	// effProcessEvents, summed over every node
+	STAGE_PROCESS,	// processReplacing, summed over every node
+	NUM_TELEMETRY_STAGES,
+};
+
+static const char* TELEMETRY_STAGE_NAMES[NUM_TELEMETRY_STAGES] = { "schedule", "dispatch", "process" };
+
+// Block render time as a share of the block's duration, 10% per bucket.
+// The last bucket has every block that took twice its duration or more.
+static const int TELEMETRY_LOAD_BUCKETS = 21;
+
+// What the counters held at one moment. Everything counts from the start
+// of audio.
+struct TelemetrySnapshot
+{
+	unsigned long long numBlocks;
+	unsigned long long numFrames;
+	// nanoseconds spent rendering blocks, start to finish
+	unsigned long long blockTime;
+	unsigned long long maxBlockTime;
+	// blocks that took longer than their duration
+	unsigned long long numOverBudget;
+	unsigned long long loadHistogram[TELEMETRY_LOAD_BUCKETS];
+	unsigned long long stageTime[NUM_TELEMETRY_STAGES];
+	unsigned long long maxStageTime[NUM_TELEMETRY_STAGES];
+	// note events sent to the instruments
+	unsigned long long numEvents;
+	unsigned long long maxBlockEvents;
+	// from the audio backend: the device ran dry, or was handed audio it
+	// had no room for
+	unsigned long long numUnderflows;
+	unsigned long long numOverflows;
+};
+
+class Telemetry
+{
+public:
+	typedef chrono::steady_clock Clock;
+
+	Telemetry() : sampleRate_(44100) { Reset(); }
+
+	// For the load histogram, before audio starts
+	void SetSampleRate(double sampleRate) { sampleRate_ = sampleRate; }
+
+	// Not while audio runs
+	void Reset()
+	{
+		numBlocks_ = 0;
+		numFrames_ = 0;
+		blockTime_ = 0;
+		maxBlockTime_ = 0;
+		numOverBudget_ = 0;
+		for (int i=0; i<TELEMETRY_LOAD_BUCKETS; i++) {
+			loadHistogram_[i] = 0;
+		}
+		for (int i=0; i<NUM_TELEMETRY_STAGES; i++) {
+			stageTime_[i] = 0;
+			maxStageTime_[i] = 0;
+		}
+		numEvents_ = 0;
+		maxBlockEvents_ = 0;
+	}
+
+	static Clock::time_point Now() { return Clock::now(); }
+
+	static unsigned long long Elapsed(Clock::time_point start, Clock::time_point end)
+	{
+		return (unsigned long long)chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+	}
+
+	// Any thread on the audio path
+	void AddStage(TelemetryStage stage, unsigned long long nanoseconds)
+	{
+		stageTime_[stage].fetch_add(nanoseconds, memory_order_relaxed);
+		StoreMax(maxStageTime_[stage], nanoseconds);
+	}
+
+	// Audio thread, once the block is rendered
+	void AddBlock(unsigned long frames, unsigned long long nanoseconds, unsigned long numEvents)
+	{
+		numBlocks_.fetch_add(1, memory_order_relaxed);
+		numFrames_.fetch_add(frames, memory_order_relaxed);
+		blockTime_.fetch_add(nanoseconds, memory_order_relaxed);
+		StoreMax(maxBlockTime_, nanoseconds);
+		numEvents_.fetch_add(numEvents, memory_order_relaxed);
+		StoreMax(maxBlockEvents_, numEvents);
+
+		double budget = frames * 1e9 / sampleRate_;
+		int bucket = (int)(nanoseconds * 10 / budget);
+		if (bucket >= TELEMETRY_LOAD_BUCKETS) {
+			bucket = TELEMETRY_LOAD_BUCKETS - 1;
+		}
+		loadHistogram_[bucket].fetch_add(1, memory_order_relaxed);
+		if (nanoseconds > budget) {
+			numOverBudget_.fetch_add(1, memory_order_relaxed);
+		}
+	}
+
+	// Any thread. The counters are read one by one while the audio path
+	// carries on, so a snapshot can be a block out between them.
+	void Snapshot(TelemetrySnapshot& s) const
+	{
+		s.numBlocks = numBlocks_.load(memory_order_relaxed);
+		s.numFrames = numFrames_.load(memory_order_relaxed);
+		s.blockTime = blockTime_.load(memory_order_relaxed);
+		s.maxBlockTime = maxBlockTime_.load(memory_order_relaxed);
+		s.numOverBudget = numOverBudget_.load(memory_order_relaxed);
+		for (int i=0; i<TELEMETRY_LOAD_BUCKETS; i++) {
+			s.loadHistogram[i] = loadHistogram_[i].load(memory_order_relaxed);
+		}
+		for (int i=0; i<NUM_TELEMETRY_STAGES; i++) {
+			s.stageTime[i] = stageTime_[i].load(memory_order_relaxed);
+			s.maxStageTime[i] = maxStageTime_[i].load(memory_order_relaxed);
+		}
+		s.numEvents = numEvents_.load(memory_order_relaxed);
+		s.maxBlockEvents = maxBlockEvents_.load(memory_order_relaxed);
+		s.numUnderflows = 0;
+		s.numOverflows = 0;
+	}
+
+private:
+	static void StoreMax(atomic<unsigned long long>& max, unsigned long long value)
+	{
+		unsigned long long current = max.load(memory_order_relaxed);
+		while (value > current && !max.compare_exchange_weak(current, value, memory_order_relaxed)) {
+		}
+	}
+
+	double sampleRate_;
+	atomic<unsigned long long> numBlocks_;
+	atomic<unsigned long long> numFrames_;
+	atomic<unsigned long long> blockTime_;
+	atomic<unsigned long long> maxBlockTime_;
+	atomic<unsigned long long> numOverBudget_;
+	atomic<unsigned long long> loadHistogram_[TELEMETRY_LOAD_BUCKETS];
+	atomic<unsigned long long> stageTime_[NUM_TELEMETRY_STAGES];
+	atomic<unsigned long long> maxStageTime_[NUM_TELEMETRY_STAGES];
+	atomic<unsigned long long> numEvents_;
+	atomic<unsigned long long> maxBlockEvents_;
+};
+
+// A few lines on stdout: block load against the deadline, the time per
+// stage and the device's xruns
+void PrintTelemetry(const TelemetrySnapshot& s, double sampleRate)
+{
+	if (s.numBlocks == 0) {
+		printf("TELEMETRY> no blocks rendered\n");
+		return;
+	}
+	double budget = s.numFrames * 1e9 / sampleRate;
+	double blockBudget = budget / s.numBlocks;
+	printf("TELEMETRY> %llu blocks, load %.1f%% average, %.1f%% max, %llu over budget, %llu underflows, %llu overflows\n",
+		s.numBlocks, 100.0 * s.blockTime / budget, 100.0 * s.maxBlockTime / blockBudget,
+		s.numOverBudget, s.numUnderflows, s.numOverflows);
+	for (int i=0; i<NUM_TELEMETRY_STAGES; i++) {
+		printf("TELEMETRY> %-9s %8.1f us average %8.1f us max\n", TELEMETRY_STAGE_NAMES[i],
+			s.stageTime[i] / 1e3 / s.numBlocks, s.maxStageTime[i] / 1e3);
+	}
+	printf("TELEMETRY> events    %8.2f per block %6llu max\n", (double)s.numEvents / s.numBlocks, s.maxBlockEvents);
+	printf("TELEMETRY> load");
+	for (int i=0; i<TELEMETRY_LOAD_BUCKETS; i++) {
+		if (s.loadHistogram[i] > 0) {
+			if (i == TELEMETRY_LOAD_BUCKETS - 1) {
+				printf(" %d%%+:%llu", i * 10, s.loadHistogram[i]);
+			}
+			else {
+				printf(" %d-%d%%:%llu", i * 10, i * 10 + 10, s.loadHistogram[i]);
+			}
+		}
+	}
+	printf("\n");
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef TEMPOMAP_H
+#define TEMPOMAP_H
+
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+// Musical time is counted in ticks, PPQ to the beat. Every length in the
+// language is a whole number of beats, so tick positions are always exact.
+static const int PPQ = 960;
+// there are no time signatures yet, every bar is four beats
+static const int BEATS_PER_BAR = 4;
+static const float DEFAULT_BPM = 200;
+static const double DEFAULT_SAMPLE_RATE = 44100;
+
+///////////////////////////
+// Tempo map
+///////////////////////////
+
+// Converts tick positions to sample positions for a song whose tempo can
+// change. The map is a list of segments of constant tempo; each segment's
+// first sample is worked out once, when the map or the sample rate changes,
+// so a conversion is a search for the segment and one multiply. Positions
+// are rounded once per conversion and never accumulated, so there is no
+// drift however long the song runs.
+class TempoMap
+{
+public:
+	TempoMap() : sampleRate_(DEFAULT_SAMPLE_RATE)
+	{
+		Segment first = { 0, DEFAULT_BPM, 0, 0 };
+		segments_.push_back(first);
+		Update();
+	}
+
+	// Change the tempo from tick onwards. A change at a tick that already
+	// has one replaces it.
+	void SetTempo(long long tick, float bpm)
+	{
+		if (tick < 0 || bpm <= 0) {
+			return;
+		}
+		size_t i = FindSegment(tick);
+		if (segments_[i].tick == tick) {
+			segments_[i].bpm = bpm;
+		}
+		else {
+			Segment segment = { tick, bpm, 0, 0 };
+			segments_.insert(segments_.begin() + i + 1, segment);
+		}
+		Update();
+	}
+
+	// Tempo at the start of the song
+	float GetInitialTempo() const { return segments_[0].bpm; }
+	size_t GetNumChanges() const { return segments_.size() - 1; }
+
+	void SetSampleRate(double sampleRate)
+	{
+		sampleRate_ = sampleRate;
+		Update();
+	}
+	double GetSampleRate() const { return sampleRate_; }
+
+	long long TickToSample(long long tick) const
+	{
+		const Segment& s = segments_[FindSegment(tick)];
+		return s.sample + (long long)((tick - s.tick) * s.samplesPerTick + 0.5);
+	}
+
+private:
+	struct Segment
+	{
+		long long tick;
+		float bpm;
+		long long sample; // sample position of tick
+		double samplesPerTick;
+	};
+
+	// Index of the segment holding tick
+	size_t FindSegment(long long tick) const
+	{
+		size_t lo = 0, hi = segments_.size();
+		while (hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			if (segments_[mid].tick <= tick) {
+				lo = mid;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+	void Update()
+	{
+		for (size_t i=0; i<segments_.size(); i++) {
+			Segment& s = segments_[i];
+			s.samplesPerTick = 60.0 * sampleRate_ / ((double)s.bpm * PPQ);
+			if (i > 0) {
+				const Segment& prev = segments_[i - 1];
+				s.sample = prev.sample + (long long)((s.tick - prev.tick) * prev.samplesPerTick + 0.5);
+			}
+		}
+	}
+
+	vector<Segment> segments_;
+	double sampleRate_;
+};
+
+#endif
@@ -0,0 +1,313 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+using namespace std;
+
+static const unsigned char MIDI_NOTE_OFF = 0x80;
+static const unsigned char MIDI_NOTE_ON = 0x90;
+static const unsigned char MIDI_CONTROL_CHANGE = 0xB0;
+static const unsigned char MIDI_ALL_NOTES_OFF = 123; // controller number
+static const int MIDI_CHANNELS = 16;
+// a note is keyed by its channel and pitch, channel * 128 + pitch
+static const int MIDI_NUM_KEYS = MIDI_CHANNELS * 128;
+
+inline bool IsNoteOff(unsigned char status) { return (status & 0xF0) == MIDI_NOTE_OFF; }
+inline int GetChannel(unsigned char status) { return status & 0x0F; }
+inline int GetNoteKey(unsigned char status, unsigned char pitch) { return (GetChannel(status) << 7) | (pitch & 0x7F); }
+
+///////////////////////////
+// Timeline
+///////////////////////////
+
+// A compiled song. Every note on and note off is stored at the sample
+// position it falls on, sorted by time, in parallel arrays so playback
+// only has to walk contiguous memory. Statuses carry the MIDI channel in
+// their low four bits. The arrays are either owned by the
+// timeline or, see View, borrowed from memory such as a mapped song cache.
+class Timeline
+{
+public:
+	Timeline() { Sync(); }
+
+	void Clear()
+	{
+		positions_.clear();
+		status_.clear();
+		pitch_.clear();
+		velocity_.clear();
+		noteIndex_.clear();
+		bars_.clear();
+		Sync();
+	}
+
+	// Play arrays that live elsewhere, without copying them. The memory must
+	// stay valid until the timeline is cleared or refilled.
+	void View(const long long* positions, const unsigned char* status,
+		const unsigned char* pitch, const unsigned char* velocity, size_t numEvents)
+	{
+		Clear();
+		positionData_ = positions;
+		statusData_ = status;
+		pitchData_ = pitch;
+		velocityData_ = velocity;
+		numEvents_ = numEvents;
+	}
+
+	void Reserve(size_t numEvents)
+	{
+		positions_.reserve(numEvents);
+		status_.reserve(numEvents);
+		pitch_.reserve(numEvents);
+		velocity_.reserve(numEvents);
+	}
+
+	void Add(long long position, unsigned char status, unsigned char pitch, unsigned char velocity)
+	{
+		positions_.push_back(position);
+		status_.push_back(status);
+		pitch_.push_back(pitch);
+		velocity_.push_back(velocity);
+		Sync();
+	}
+
+	// Sort the events by position. Note offs go before note ons at the same
+	// position so a retriggered pitch is released before it is struck again.
+	void Sort()
+	{
+		size_t numEvents = positions_.size();
+		vector<size_t> order(numEvents);
+		for (size_t i=0; i<numEvents; i++) {
+			order[i] = i;
+		}
+		stable_sort(order.begin(), order.end(), EventOrder(this));
+
+		vector<long long> positions(numEvents);
+		vector<unsigned char> status(numEvents);
+		vector<unsigned char> pitch(numEvents);
+		vector<unsigned char> velocity(numEvents);
+		for (size_t i=0; i<numEvents; i++) {
+			positions[i] = positions_[order[i]];
+			status[i] = status_[order[i]];
+			pitch[i] = pitch_[order[i]];
+			velocity[i] = velocity_[order[i]];
+		}
+		positions_.swap(positions);
+		status_.swap(status);
+		pitch_.swap(pitch);
+		velocity_.swap(velocity);
+		Sync();
+	}
+
+	size_t GetNumEvents() const { return numEvents_; }
+	long long GetPosition(size_t i) const { return positionData_[i]; }
+	unsigned char GetStatus(size_t i) const { return statusData_[i]; }
+	unsigned char GetPitch(size_t i) const { return pitchData_[i]; }
+	unsigned char GetVelocity(size_t i) const { return velocityData_[i]; }
+
+	// The arrays themselves, for writing the timeline out
+	const long long* GetPositions() const { return positionData_; }
+	const unsigned char* GetStatuses() const { return statusData_; }
+	const unsigned char* GetPitches() const { return pitchData_; }
+	const unsigned char* GetVelocities() const { return velocityData_; }
+
+	// Index of the first event at or after the given position
+	size_t Find(long long position) const
+	{
+		return lower_bound(positionData_, positionData_ + numEvents_, position) - positionData_;
+	}
+
+	// Index the timeline for locating: a checkpoint of the notes sounding
+	// every NOTE_INDEX_INTERVAL events, MIDI_NUM_KEYS bytes each, and the
+	// position each bar starts at.
+	// barPositions run from bar 0 up to the end of the song. Call once the
+	// timeline is complete.
+	void BuildIndex(const vector<long long>& barPositions)
+	{
+		noteIndex_.clear();
+		noteIndex_.reserve((numEvents_ / NOTE_INDEX_INTERVAL + 1) * MIDI_NUM_KEYS);
+		unsigned char sounding[MIDI_NUM_KEYS];
+		memset(sounding, 0, sizeof(sounding));
+		for (size_t i=0; i<numEvents_; i++) {
+			if (i % NOTE_INDEX_INTERVAL == 0) {
+				noteIndex_.insert(noteIndex_.end(), sounding, sounding + MIDI_NUM_KEYS);
+			}
+			Apply(i, sounding);
+		}
+		bars_ = barPositions;
+		Sync();
+	}
+
+	// Use an index that lives elsewhere, like View does for the events
+	void ViewIndex(const unsigned char* noteIndex, size_t noteIndexSize, const long long* bars, size_t numBars)
+	{
+		noteIndexData_ = noteIndex;
+		noteIndexSize_ = noteIndexSize;
+		barData_ = bars;
+		numBars_ = numBars;
+	}
+
+	// The notes sounding just before event index, i.e. struck by an earlier
+	// event and not yet released, as the velocity each was struck with per
+	// note key, 0 for silent ones. Costs one checkpoint copy and at most
+	// NOTE_INDEX_INTERVAL events.
+	void GetSounding(size_t index, unsigned char sounding[MIDI_NUM_KEYS]) const
+	{
+		size_t checkpoint = index / NOTE_INDEX_INTERVAL;
+		size_t i = 0;
+		if ((checkpoint + 1) * MIDI_NUM_KEYS <= noteIndexSize_) {
+			memcpy(sounding, noteIndexData_ + checkpoint * MIDI_NUM_KEYS, MIDI_NUM_KEYS);
+			i = checkpoint * NOTE_INDEX_INTERVAL;
+		}
+		else {
+			memset(sounding, 0, MIDI_NUM_KEYS);
+		}
+		for (; i<index && i<numEvents_; i++) {
+			Apply(i, sounding);
+		}
+	}
+
+	// Sample position bar starts at, bars counted from 0. Bars past the end
+	// of the song give the end of the last one.
+	long long GetBarPosition(size_t bar) const
+	{
+		if (numBars_ == 0) {
+			return 0;
+		}
+		return barData_[bar < numBars_ ? bar : numBars_ - 1];
+	}
+	size_t GetNumBars() const { return numBars_; }
+
+	const unsigned char* GetNoteIndex() const { return noteIndexData_; }
+	size_t GetNoteIndexSize() const { return noteIndexSize_; }
+	const long long* GetBars() const { return barData_; }
+
+private:
+	static const size_t NOTE_INDEX_INTERVAL = 256;
+
+	void Apply(size_t i, unsigned char sounding[MIDI_NUM_KEYS]) const
+	{
+		sounding[GetNoteKey(statusData_[i], pitchData_[i])] = IsNoteOff(statusData_[i]) ? 0 : velocityData_[i];
+	}
+
+	// a copy would point at the other timeline's arrays
+	Timeline(const Timeline&);
+	Timeline& operator=(const Timeline&);
+
+	// point the accessors back at the owned arrays
+	void Sync()
+	{
+		numEvents_ = positions_.size();
+		positionData_ = positions_.empty() ? NULL : &positions_[0];
+		statusData_ = status_.empty() ? NULL : &status_[0];
+		pitchData_ = pitch_.empty() ? NULL : &pitch_[0];
+		velocityData_ = velocity_.empty() ? NULL : &velocity_[0];
+		noteIndexData_ = noteIndex_.empty() ? NULL : &noteIndex_[0];
+		noteIndexSize_ = noteIndex_.size();
+		barData_ = bars_.empty() ? NULL : &bars_[0];
+		numBars_ = bars_.size();
+	}
+
+	struct EventOrder
+	{
+		EventOrder(const Timeline* timeline) : timeline_(timeline) {}
+		bool operator()(size_t a, size_t b) const
+		{
+			if (timeline_->positions_[a] != timeline_->positions_[b]) {
+				return timeline_->positions_[a] < timeline_->positions_[b];
+			}
+			return IsNoteOff(timeline_->status_[a]) && !IsNoteOff(timeline_->status_[b]);
+		}
+		const Timeline* timeline_;
+	};
+
+	vector<long long> positions_;
+	vector<unsigned char> status_;
+	vector<unsigned char> pitch_;
+	vector<unsigned char> velocity_;
+
+	const long long* positionData_;
+	const unsigned char* statusData_;
+	const unsigned char* pitchData_;
+	const unsigned char* velocityData_;
+	size_t numEvents_;
+
+	// velocities of the sounding notes at every NOTE_INDEX_INTERVAL'th
+	// event, MIDI_NUM_KEYS bytes each, and the sample position of every bar
+	vector<unsigned char> noteIndex_;
+	vector<long long> bars_;
+	const unsigned char* noteIndexData_;
+	size_t noteIndexSize_;
+	const long long* barData_;
+	size_t numBars_;
+};
+
+// Playback position in a timeline. Each call to Advance hands back the slice
+// of events that fall inside the next block, which is all the audio callback
+// needs to do per block.
+class TimelineCursor
+{
+public:
+	TimelineCursor() : timeline_(NULL), index_(0), position_(0) {}
+
+	void SetTimeline(const Timeline* timeline)
+	{
+		timeline_ = timeline;
+		Reset();
+	}
+
+	void Reset()
+	{
+		index_ = 0;
+		position_ = 0;
+	}
+
+	// Carry on in another timeline from the same position
+	void Switch(const Timeline* timeline)
+	{
+		timeline_ = timeline;
+		Locate(position_);
+	}
+
+	// Jump to a sample position, O(log n) in the number of events
+	void Locate(long long position)
+	{
+		position_ = position;
+		index_ = timeline_ != NULL ? timeline_->Find(position_) : 0;
+	}
+
+	// Index of the next event to be handed out
+	size_t GetIndex() const { return index_; }
+
+	// Returns the events in [first, last) that fall inside the next block of
+	// frames and moves the cursor to the start of the following block.
+	void Advance(unsigned long frames, size_t& first, size_t& last)
+	{
+		first = index_;
+		position_ += frames;
+		if (timeline_ != NULL) {
+			size_t numEvents = timeline_->GetNumEvents();
+			while (index_ < numEvents && timeline_->GetPosition(index_) < position_) {
+				index_++;
+			}
+		}
+		last = index_;
+	}
+
+	// Sample position of the start of the next block
+	long long GetPosition() const { return position_; }
+
+	bool IsFinished() const
+	{
+		return timeline_ == NULL || index_ >= timeline_->GetNumEvents();
+	}
+
+private:
+	const Timeline* timeline_;
+	size_t index_;
+	long long position_;
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <atomic>
+using namespace std;
+
+///////////////////////////
+// Transport
+///////////////////////////
+
+enum TransportCommandType
+{
+	TRANSPORT_PLAY,
+	TRANSPORT_STOP,
+	TRANSPORT_LOCATE,      // a: sample position
+	TRANSPORT_LOCATE_BAR,  // a: bar, counted from 0
+	TRANSPORT_LOOP,        // a, b: start and end sample positions
+	TRANSPORT_LOOP_BARS,   // a, b: first bar and the bar after the last
+	TRANSPORT_LOOP_OFF,
+};
+
+struct TransportCommand
+{
+	TransportCommandType type;
+	long long a;
+	long long b;
+};
+
+static const int TRANSPORT_QUEUE_SIZE = 64; // must be a power of 2
+
+// Single producer, single consumer queue carrying transport commands from
+// a control thread to the audio thread. Neither side ever blocks.
+class TransportQueue
+{
+public:
+	TransportQueue() : head_(0), tail_(0) {}
+
+	// Control thread. Returns false if the audio thread has fallen behind
+	// and the queue is full.
+	bool Push(TransportCommandType type, long long a = 0, long long b = 0)
+	{
+		unsigned int head = head_.load(memory_order_relaxed);
+		if (head - tail_.load(memory_order_acquire) >= TRANSPORT_QUEUE_SIZE) {
+			return false;
+		}
+		TransportCommand& c = commands_[head & (TRANSPORT_QUEUE_SIZE - 1)];
+		c.type = type;
+		c.a = a;
+		c.b = b;
+		head_.store(head + 1, memory_order_release);
+		return true;
+	}
+
+	// Audio thread
+	bool Pop(TransportCommand& c)
+	{
+		unsigned int tail = tail_.load(memory_order_relaxed);
+		if (tail == head_.load(memory_order_acquire)) {
+			return false;
+		}
+		c = commands_[tail & (TRANSPORT_QUEUE_SIZE - 1)];
+		tail_.store(tail + 1, memory_order_release);
+		return true;
+	}
+
+private:
+	TransportCommand commands_[TRANSPORT_QUEUE_SIZE];
+	atomic<unsigned int> head_;
+	atomic<unsigned int> tail_;
+};
+
+#endif
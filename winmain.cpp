@@ -17,6 +17,9 @@ static TCHAR szTitle[] = _T("Win32 Guided Tour Application");
 
 HINSTANCE hInst;
 
+// the song this window plays
+Session session;
+
 // Forward declarations of functions included in this code module:
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
 
@@ -32,7 +35,10 @@ int WINAPI WinMain(HINSTANCE hInstance,
 		return 1;
 	}
 
-	LoadPlugin();
+	if (!session.LoadPlugin()) {
+		// fall back to the built-in synth so there is still something to hear
+		session.LoadBuiltinSynth();
+	}
 
     WNDCLASSEX wcex;
 
@@ -80,7 +86,7 @@ int WINAPI WinMain(HINSTANCE hInstance,
         NULL,
         NULL,
         hInstance,
-        effect
+        session.GetEffect()
     );
 
     if (!hWnd)
@@ -99,14 +105,16 @@ int WINAPI WinMain(HINSTANCE hInstance,
     ShowWindow(hWnd, nCmdShow);
     UpdateWindow(hWnd);
 
-	// parse input file
-	init_table();
-	is.open("C:\\Documents and Settings\\George\\My Documents\\luma2\\input.txt", ifstream::in);
-	int ret = yyparse();
-	is.close();
+	// parse input file and flatten it into a timeline for the audio callback,
+	// or map the timeline compiled last time if the file has not changed
+	const char* songFile = "C:\\Documents and Settings\\George\\My Documents\\luma2\\input.txt";
+	int ret = session.Load(songFile, true);
 
 	// start the audio after everything has been initialized
-	StartAudio();
+	session.StartAudio();
+
+	// pick up edits to the song while it plays
+	session.StartWatching(songFile);
 
 	/*for (int i=0; i<100; i++)
 	{
@@ -156,7 +164,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		SetWindowText (hWnd, "VST Editor");
 		//SetTimer (hwnd, 1, 20, 0);
 
-		if (effect)
+		if (AEffect* effect = session.GetEffect())
 		{
 			printf ("HOST> Open editor...\n");
 			effect->dispatcher (effect, effEditOpen, 0, 0, hWnd, 0);
@@ -186,7 +194,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 	//-----------------------
 	/*case WM_TIMER :
-		if (effect)
+		if (AEffect* effect = session.GetEffect())
 			effect->dispatcher (effect, effEditIdle, 0, 0, 0, 0);
 		break;*/
 
@@ -196,10 +204,10 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 		//KillTimer (hwnd, 1);
 
 		printf ("HOST> Close editor..\n");
-		if (effect)
+		if (AEffect* effect = session.GetEffect())
 			effect->dispatcher (effect, effEditClose, 0, 0, 0, 0);
 
-		Cleanup();
+		session.Cleanup();
 
 		DestroyWindow(hWnd);
 